@@ -0,0 +1,91 @@
+#!/bin/bash
+# Correctness check for reads that are in order but small. Each parser has to
+# get the right answer for a file read with read() and with pread() from a
+# single thread, in reads small enough that there are more of them than the
+# summaries map has room for. If in order reads were being summarised, the
+# map would fill up, no_space would go up and the result would come out
+# incomplete. Prints one line per parser and reader, and exits non-zero if any
+# of them is wrong.
+#
+# Run as root from day1/ (or via make check).
+#
+#   bench/check.sh [-p "p1 p2b"] [-s size] [-b read_size]
+
+set -e
+cd "$(dirname "$0")/.."
+
+PARTS="p1 p1s p1b p2 p2a p2b"
+# 65536 entries in summaries, at 64 bytes a read, is 4M
+SIZE=8M
+READ_SIZE=64
+
+while getopts "p:s:b:" opt; do
+	case $opt in
+	p) PARTS=$OPTARG ;;
+	s) SIZE=$OPTARG ;;
+	b) READ_SIZE=$OPTARG ;;
+	*) exit 1 ;;
+	esac
+done
+
+WORK=$(mktemp -d)
+loader=
+trap '[ -n "$loader" ] && kill -INT $loader 2>/dev/null; rm -rf $WORK' EXIT
+
+make -s all bench/reader
+
+python3 bench/gen_input.py gen --size $SIZE > $WORK/advent.test
+python3 bench/gen_input.py solve $WORK/advent.test > $WORK/expected
+bytes=$(stat -c %s $WORK/advent.test)
+if ((bytes / READ_SIZE <= 65536)); then
+	echo "$SIZE in reads of $READ_SIZE doesn't fill summaries" >&2
+	exit 1
+fi
+
+failed=0
+printf "%-4s %-8s %-3s %12s %12s %8s\n" "PART" "READER" "OK" "TOTAL" "EXPECTED" "NO_SPACE"
+for part in $PARTS; do
+	# p1, p1s and p1b check against the part 1 answer, everything else against part 2
+	case $part in
+	p1*) answer=p1 ;;
+	*) answer=p2 ;;
+	esac
+	expected=$(awk -v a=$answer '{ for (i = 1; i < NF; i++) if ($i == a) print $(i + 1) }' $WORK/expected)
+
+	for reader in read pread; do
+		log=$WORK/day1.log
+		./day1 --parser $part --stats --file $WORK/advent.test > $log &
+		loader=$!
+		sleep 3
+
+		case $reader in
+		read) bench/reader -b $READ_SIZE $WORK/advent.test > /dev/null ;;
+		pread) bench/reader -b $READ_SIZE -t 1 $WORK/advent.test > /dev/null ;;
+		esac
+
+		# Give the result time to come through the ring buffer
+		sleep 1
+		kill -INT $loader
+		wait $loader || true
+		loader=
+
+		# A result line has the file name in column 4 and the total in
+		# column 5, and anything after that flags it as incomplete
+		if ! awk -v part=$part -v reader=$reader -v expected=$expected '
+			$4 == "advent.test" && $2 ~ /^[0-9]+$/ {
+				results++
+				total = $5
+				if ($5 != expected || NF > 5) bad++
+			}
+			$1 == "no_space" { nospace = $2 }
+			END {
+				ok = (results == 1 && !bad && !nospace) ? "yes" : "NO"
+				printf "%-4s %-8s %-3s %12s %12s %8d\n",
+					part, reader, ok, total, expected, nospace
+				exit ok != "yes"
+			}' $log; then
+			failed=1
+		fi
+	done
+done
+exit $failed
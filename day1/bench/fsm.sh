@@ -0,0 +1,52 @@
+#!/bin/bash
+# Compare the per-byte cost of the hash table FSM (p2a) with the dense table
+# FSM (p2b), using the kernel's BPF run time stats. Run as root from day1/.
+#
+#   bench/fsm.sh [iterations]
+
+set -e
+cd "$(dirname "$0")/.."
+
+ITERATIONS=${1:-20}
+SYNTH=$(mktemp -d)
+
+python3 bench/gen_input.py gen --size 4M --word-density 0.9 --digit-density 0.2 --seed 1 > $SYNTH/words
+python3 bench/gen_input.py gen --size 4M --word-density 0.1 --digit-density 0.2 --seed 2 > $SYNTH/digits
+INPUTS="advent.full $SYNTH/words $SYNTH/digits"
+
+# Sum of run_time_ns and run_cnt over the named programs
+prog_stats() {
+	bpftool prog show --json | jq -r --arg names "$*" '
+		[.[] | select(.name | IN($names | split(" ")[]))] |
+		"\(map(.run_time_ns // 0) | add) \(map(.run_cnt // 0) | add)"'
+}
+
+make -s
+sysctl -q kernel.bpf_stats_enabled=1
+trap 'sysctl -q kernel.bpf_stats_enabled=0; rm -rf $SYNTH advent.test' EXIT
+
+printf "%-6s %-20s %10s %12s %10s\n" "PART" "FILE" "BYTES" "NS/READ" "NS/BYTE"
+# day1 watches files by inode, so advent.test has to be there before it starts.
+# cp below overwrites it in place, so it stays the same file
+touch advent.test
+for part in p2a p2b; do
+	./day1 --parser $part --file advent.test > /dev/null &
+	loader=$!
+	sleep 3
+
+	for f in $INPUTS; do
+		cp $f advent.test
+		bytes=$(stat -c %s $f)
+		read -r ns_before cnt_before < <(prog_stats vfs_read_ret buffer_read_$part fexit_read)
+		for ((i = 0; i < ITERATIONS; i++)); do
+			cat advent.test > /dev/null
+		done
+		read -r ns_after cnt_after < <(prog_stats vfs_read_ret buffer_read_$part fexit_read)
+		ns=$((ns_after - ns_before))
+		awk -v part=$part -v f=$(basename $f) -v b=$bytes -v ns=$ns -v n=$ITERATIONS \
+			'BEGIN { printf "%-6s %-20s %10d %12.0f %10.2f\n", part, f, b, ns / n, ns / (n * b) }'
+	done
+
+	kill -INT $loader
+	wait $loader || true
+done
@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+# Generate synthetic Day 1 puzzle input, or work out the expected answers for
+# an input file so benchmark runs can check what the BPF programs report.
+#
+#   gen_input.py gen --size 10M --line-len 40 --word-density 0.5 > big.advent
+#   gen_input.py solve big.advent
+
+import argparse
+import random
+import sys
+
+WORDS = ["one", "two", "three", "four", "five", "six", "seven", "eight", "nine"]
+LETTERS = "abcdefghijklmnopqrstuvwxyz"
+
+
+def parse_size(s):
+    units = {"K": 1 << 10, "M": 1 << 20, "G": 1 << 30}
+    if s[-1].upper() in units:
+        return int(float(s[:-1]) * units[s[-1].upper()])
+    return int(s)
+
+
+def gen_line(rnd, line_len, word_density, digit_density):
+    line = []
+    length = 0
+    while length < line_len:
+        r = rnd.random()
+        if r < digit_density:
+            if rnd.random() < word_density:
+                tok = rnd.choice(WORDS)
+            else:
+                tok = rnd.choice("123456789")
+        else:
+            tok = rnd.choice(LETTERS)
+        line.append(tok)
+        length += len(tok)
+    # Every line needs at least one digit for the puzzle to make sense
+    line.append(rnd.choice("123456789"))
+    return "".join(line) + "\n"
+
+
+def gen(args):
+    rnd = random.Random(args.seed)
+    size = parse_size(args.size)
+    out = sys.stdout
+    written = 0
+    # Lines come from a pool so generating gigabytes doesn't take all day
+    pool = [gen_line(rnd, args.line_len, args.word_density, args.digit_density) for _ in range(4096)]
+    while written < size:
+        line = rnd.choice(pool)
+        out.write(line)
+        written += len(line)
+
+
+def line_value(line, words):
+    digits = []
+    for i, c in enumerate(line):
+        if c.isdigit():
+            digits.append(int(c))
+        elif words:
+            for n, w in enumerate(WORDS):
+                if line.startswith(w, i):
+                    digits.append(n + 1)
+    if not digits:
+        return 0
+    return digits[0] * 10 + digits[-1]
+
+
+def solve(args):
+    p1 = p2 = lines = 0
+    with open(args.file) as f:
+        for line in f:
+            lines += 1
+            p1 += line_value(line, False)
+            p2 += line_value(line, True)
+    print(f"lines {lines} p1 {p1} p2 {p2}")
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    sub = ap.add_subparsers(dest="cmd", required=True)
+    g = sub.add_parser("gen")
+    g.add_argument("--size", default="1M", help="bytes to generate, e.g. 64K, 10M, 1G")
+    g.add_argument("--line-len", type=int, default=40, help="approximate characters per line")
+    g.add_argument("--word-density", type=float, default=0.5, help="fraction of digits spelled out as words")
+    g.add_argument("--digit-density", type=float, default=0.1, help="fraction of tokens that are digits")
+    g.add_argument("--seed", type=int, default=1)
+    s = sub.add_parser("solve")
+    s.add_argument("file")
+    args = ap.parse_args()
+    if args.cmd == "gen":
+        gen(args)
+    else:
+        solve(args)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,67 @@
+#!/bin/bash
+# Verifier cost and load time for each parser at a range of chunk sizes
+# (ADVENT_BUFFER_LEN). For each size it rebuilds day1, loads the programs for
+# each parser without attaching them (day1 --load-stats) and reports, for the
+# programs that do the parsing:
+#
+#   INSNS      instructions the verifier went through
+#   PEAK       peak number of verifier states
+#   STATES     total number of verifier states
+#   STACK      stack depth of the program and each of its callbacks
+#   XLATED     size after the verifier's rewrites, in bytes
+#   JITED      size of the JITed code, in bytes
+#   VERIFY_US  time spent verifying the program
+#   LOAD_MS    wall clock time to load the whole object
+#
+# A size that doesn't verify shows up as FAILED, followed by the end of the
+# verifier log for the program that failed. day1 is rebuilt with the
+# default size at the end. Run as root from day1/.
+#
+#   bench/loadcost.sh [-p "p1 p2b"] [-b "4096 32768 131072"] [-k]
+
+set -e
+cd "$(dirname "$0")/.."
+
+PARTS="p1 p1s p1b p2 p2a p2b"
+LENS="256 4096 32768 131072"
+MODE=
+WANT=fentry/fexit
+
+while getopts "p:b:k" opt; do
+	case $opt in
+	p) PARTS=$OPTARG ;;
+	b) LENS=$OPTARG ;;
+	k) MODE=--kprobes; WANT=kprobes ;;
+	*) exit 1 ;;
+	esac
+done
+
+rebuild() {
+	rm -f day1.bpf.o day1.skel.h
+	make -s day1 BPF_CFLAGS="$1"
+}
+trap 'rebuild ""' EXIT
+
+printf "%-4s %8s %-20s %10s %8s %8s %-12s %8s %8s %10s %8s\n" \
+	"PART" "BUF_LEN" "PROG" "INSNS" "PEAK" "STATES" "STACK" "XLATED" "JITED" "VERIFY_US" "LOAD_MS"
+for len in $LENS; do
+	rebuild -DADVENT_BUFFER_LEN=$len
+	for part in $PARTS; do
+		# day1 says which attach mode it loaded, so a kprobe load can't
+		# pass for an fentry/fexit one
+		if ! out=$(./day1 --parser $part --load-stats $MODE 2>&1) ||
+		   ! grep -qx "MODE $WANT" <<< "$out"; then
+			printf "%-4s %8s %-20s FAILED\n" $part $len "-"
+			echo "$out" | tail -n 20 | sed 's/^/    /'
+			continue
+		fi
+		# fexit_read and fexit_filemap_read run whichever parser is in
+		# .rodata; with kprobes it's buffer_read_<part>
+		echo "$out" | awk -v part=$part -v len=$len '
+			$1 == "LOAD_MS" { load = $2; next }
+			$1 == "fexit_read" || $1 == "fexit_filemap_read" || $1 == "buffer_read_" part {
+				printf "%-4s %8s %-20s %10s %8s %8s %-12s %8s %8s %10s %8s\n",
+					part, len, $1, $2, $3, $4, $5, $6, $7, $8, load
+			}'
+	done
+done
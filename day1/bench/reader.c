@@ -0,0 +1,136 @@
+// Read a file from start to finish with a fixed read() size and throw the data
+// away. day1 watches for this program by name, so it stands in for cat when we
+// want to control how the file gets split up into reads. With -t, that many
+// threads share the file and pread() blocks of it in an interleaved order.
+//
+//   reader [-b read_size] [-t threads] file
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+struct worker {
+	pthread_t thread;
+	int fd;
+	int index;
+	int threads;
+	size_t size;
+	off_t file_size;
+	long long total;
+	long reads;
+};
+
+// Thread i reads blocks i, i + threads, i + 2 * threads ...
+static void *pread_blocks(void *arg)
+{
+	struct worker *w = arg;
+	char *buf = malloc(w->size);
+	if (!buf) {
+		perror("malloc");
+		return NULL;
+	}
+
+	for (off_t off = (off_t)w->index * w->size; off < w->file_size; off += (off_t)w->threads * w->size) {
+		ssize_t n = pread(w->fd, buf, w->size, off);
+		if (n < 0) {
+			perror("pread");
+			break;
+		}
+		w->total += n;
+		w->reads++;
+	}
+	free(buf);
+	return NULL;
+}
+
+static int usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-b read_size] [-t threads] file\n", prog);
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	size_t size = 128 * 1024;
+	int threads = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:t:")) != -1) {
+		switch (opt) {
+		case 'b':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		default:
+			return usage(argv[0]);
+		}
+	}
+	if (optind >= argc || size == 0 || threads < 0) {
+		return usage(argv[0]);
+	}
+
+	int fd = open(argv[optind], O_RDONLY);
+	if (fd < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	long long total = 0;
+	long reads = 0;
+	double start = now_ns();
+	if (threads) {
+		struct stat st;
+		fstat(fd, &st);
+		struct worker *workers = calloc(threads, sizeof(*workers));
+		for (int i = 0; i < threads; i++) {
+			workers[i] = (struct worker) {
+				.fd = fd, .index = i, .threads = threads,
+				.size = size, .file_size = st.st_size,
+			};
+			pthread_create(&workers[i].thread, NULL, pread_blocks, &workers[i]);
+		}
+		for (int i = 0; i < threads; i++) {
+			pthread_join(workers[i].thread, NULL);
+			total += workers[i].total;
+			reads += workers[i].reads;
+		}
+		free(workers);
+	} else {
+		char *buf = malloc(size);
+		if (!buf) {
+			perror("malloc");
+			return 1;
+		}
+		for (;;) {
+			ssize_t n = read(fd, buf, size);
+			if (n < 0) {
+				perror("read");
+				return 1;
+			}
+			if (n == 0) {
+				break;
+			}
+			total += n;
+			reads++;
+		}
+		free(buf);
+	}
+	double elapsed = now_ns() - start;
+	close(fd);
+
+	// bytes, reads, nanoseconds
+	printf("%lld %ld %.0f\n", total, reads, elapsed);
+	return 0;
+}
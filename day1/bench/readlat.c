@@ -0,0 +1,48 @@
+// Time small pread()s from a file that day1 isn't interested in. Every read on
+// the system goes through our vfs_read probes, so this shows what having day1
+// loaded costs processes that have nothing to do with it.
+//
+//   readlat [file] [iterations]
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = argc > 1 ? argv[1] : "/dev/zero";
+	long iterations = argc > 2 ? atol(argv[2]) : 1000000;
+	char buf[64];
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return 1;
+	}
+
+	// Warm up
+	for (long i = 0; i < iterations / 10; i++) {
+		pread(fd, buf, sizeof(buf), 0);
+	}
+
+	double start = now_ns();
+	for (long i = 0; i < iterations; i++) {
+		if (pread(fd, buf, sizeof(buf), 0) < 0) {
+			perror("pread");
+			return 1;
+		}
+	}
+	double elapsed = now_ns() - start;
+
+	printf("%.1f\n", elapsed / iterations);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,44 @@
+#!/bin/bash
+# Measure how many nanoseconds day1 adds to an unrelated read(), with nothing
+# being tracked and with a tracked file held open (which turns off the
+# active_files short cut). Run as root from day1/ after building day1.
+#
+#   bench/readlat.sh [iterations]
+
+set -e
+cd "$(dirname "$0")/.."
+
+ITERATIONS=${1:-2000000}
+make -s bench/readlat
+
+measure() {
+	# Best of three, to keep scheduling noise out of it
+	for i in 1 2 3; do
+		bench/readlat /dev/zero $ITERATIONS
+	done | sort -n | head -1
+}
+
+base=$(measure)
+
+# day1 watches files by inode, so the FIFO has to exist before it starts
+rm -f advent.test
+mkfifo advent.test
+./day1 --file advent.test > /dev/null &
+loader=$!
+trap 'kill -INT $loader 2>/dev/null; exec 3>&-; rm -f advent.test' EXIT
+sleep 3
+idle=$(measure)
+
+# Hold a tracked file open: cat blocks reading from the FIFO
+cat advent.test > /dev/null &
+exec 3> advent.test
+sleep 1
+tracking=$(measure)
+exec 3>&-
+
+awk -v base=$base -v idle=$idle -v tracking=$tracking 'BEGIN {
+	printf "%-24s %10s %10s\n", "", "NS/READ", "ADDED"
+	printf "%-24s %10.1f %10s\n", "not loaded", base, "-"
+	printf "%-24s %10.1f %10.1f\n", "loaded, idle", idle, idle - base
+	printf "%-24s %10.1f %10.1f\n", "loaded, file tracked", tracking, tracking - base
+}'
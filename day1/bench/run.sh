@@ -0,0 +1,121 @@
+#!/bin/bash
+# Throughput and overhead benchmark for the day1 loader. For each parser,
+# input size and reader it runs day1 with --prog-stats --latency, pushes the
+# generated input through the reader a few times, checks the result against
+# gen_input.py and reports:
+#
+#   MB/s      bytes read per second of wall clock time, reader included
+#   BPF MB/s  bytes parsed per second of time spent in our BPF programs
+#   NS/BYTE   BPF run time per byte, in total and for each program
+#   LAT(us)   mean time from the file being closed to day1 printing the result
+#
+# Run as root from day1/ (or via make bench).
+#
+#   bench/run.sh [-p "p1 p2 p2a"] [-s "64K 1M 64M 1G"] [-r "cat reader:4096 reader:65536:8"]
+#                [-l line_len] [-w word_density] [-d digit_density] [-n iterations]
+
+set -e
+cd "$(dirname "$0")/.."
+
+PARTS="p1 p1s p1b p2 p2a p2b"
+SIZES="64K 1M 64M 1G"
+READERS="cat reader:4096 reader:131072 reader:131072:4"
+LINE_LEN=40
+WORD_DENSITY=0.5
+DIGIT_DENSITY=0.1
+ITERATIONS=5
+
+while getopts "p:s:r:l:w:d:n:" opt; do
+	case $opt in
+	p) PARTS=$OPTARG ;;
+	s) SIZES=$OPTARG ;;
+	r) READERS=$OPTARG ;;
+	l) LINE_LEN=$OPTARG ;;
+	w) WORD_DENSITY=$OPTARG ;;
+	d) DIGIT_DENSITY=$OPTARG ;;
+	n) ITERATIONS=$OPTARG ;;
+	*) exit 1 ;;
+	esac
+done
+
+WORK=$(mktemp -d)
+loader=
+trap '[ -n "$loader" ] && kill -INT $loader 2>/dev/null; rm -rf $WORK' EXIT
+
+make -s all bench/reader
+
+# Inputs are generated once and shared by every part, and day1 is told which
+# one to watch with --file.
+for size in $SIZES; do
+	mkdir -p $WORK/$size
+	python3 bench/gen_input.py gen --size $size --line-len $LINE_LEN \
+		--word-density $WORD_DENSITY --digit-density $DIGIT_DENSITY > $WORK/$size/advent.test
+	python3 bench/gen_input.py solve $WORK/$size/advent.test > $WORK/$size/expected
+done
+
+now_ns() {
+	date +%s%N
+}
+
+run_reader() {
+	case $1 in
+	cat) cat $2 > /dev/null ;;
+	reader:*:*) bs=${1#reader:}; bench/reader -b ${bs%:*} -t ${bs#*:} $2 > /dev/null ;;
+	reader:*) bench/reader -b ${1#reader:} $2 > /dev/null ;;
+	esac
+}
+
+printf "%-4s %-6s %-14s %-4s %10s %10s %8s %10s  %s\n" \
+	"PART" "SIZE" "READER" "OK" "MB/s" "BPF MB/s" "NS/BYTE" "LAT(us)" "NS/BYTE BY PROG"
+for part in $PARTS; do
+	# p1, p1s and p1b check against the part 1 answer, everything else against part 2
+	case $part in
+	p1*) answer=p1 ;;
+	*) answer=p2 ;;
+	esac
+
+	for size in $SIZES; do
+		file=$WORK/$size/advent.test
+		bytes=$(stat -c %s $file)
+		expected=$(awk -v a=$answer '{ for (i = 1; i < NF; i++) if ($i == a) print $(i + 1) }' $WORK/$size/expected)
+
+		for reader in $READERS; do
+			log=$WORK/day1.log
+			./day1 --parser $part --prog-stats --latency --file $file > $log &
+			loader=$!
+			sleep 3
+
+			start=$(now_ns)
+			for ((i = 0; i < ITERATIONS; i++)); do
+				run_reader $reader $file
+			done
+			wall=$(($(now_ns) - start))
+
+			# Give the last result time to come through the ring buffer
+			sleep 1
+			kill -INT $loader
+			wait $loader || true
+			loader=
+
+			awk -v part=$part -v size=$size -v reader=$reader -v expected=$expected \
+				-v bytes=$bytes -v n=$ITERATIONS -v wall=$wall '
+				$4 == "advent.test" && $2 ~ /^[0-9]+$/ {
+					results++
+					if ($5 != expected) bad++
+					lat += $6
+				}
+				$1 == "PROG" { stats = 1; next }
+				stats && NF == 4 && $2 > 0 {
+					ns += $3
+					byprog = byprog sprintf("%s=%.2f ", $1, $3 / (bytes * n))
+				}
+				END {
+					ok = (results == n && !bad) ? "yes" : "NO"
+					printf "%-4s %-6s %-14s %-4s %10.1f %10.1f %8.2f %10.1f  %s\n",
+						part, size, reader, ok,
+						bytes * n * 1000 / wall, ns ? bytes * n * 1000 / ns : 0,
+						ns / (bytes * n), results ? lat / results : 0, byprog
+				}' $log
+		done
+	done
+done
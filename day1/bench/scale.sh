@@ -0,0 +1,158 @@
+#!/bin/bash
+# How day1 copes with many readers at once. For each number of readers from 1
+# up to the number of CPUs (doubling each time), it starts that many reader
+# processes together, each reading its file a few times, with every reader
+# either on its own file ("distinct") or all on the same one ("shared"). It
+# checks every result day1 prints against gen_input.py and reports:
+#
+#   OK        every read of every file gave a result, and they were all right
+#   MB/s      bytes read by all the readers per second of wall clock time
+#   READER_MS mean time for one reader to read its file once
+#   SLOWDOWN  READER_MS over READER_MS with one reader
+#   OVERHEAD  READER_MS over READER_MS for the same readers without day1
+#   DROPPED   results that didn't fit in the ring buffer
+#   NO_SPACE  opens and reads that day1 had nowhere to keep state for (task
+#             storage, a stream slot, or the summaries map)
+#
+# Where MB/s stops going up, or SLOWDOWN grows faster than OVERHEAD does
+# without day1, is where the readers are getting in each other's way in our
+# maps or the ring buffer rather than in the page cache.
+#
+# Run as root from day1/ (or via make scale).
+#
+#   bench/scale.sh [-p "p1 p2b"] [-s size] [-n max_readers] [-b read_size]
+#                  [-i iterations] [-m "distinct shared"]
+
+set -e
+cd "$(dirname "$0")/.."
+
+PARTS="p1 p2"
+SIZE=4M
+MAX_READERS=$(nproc)
+READ_SIZE=131072
+ITERATIONS=10
+MODES="distinct shared"
+
+while getopts "p:s:n:b:i:m:" opt; do
+	case $opt in
+	p) PARTS=$OPTARG ;;
+	s) SIZE=$OPTARG ;;
+	n) MAX_READERS=$OPTARG ;;
+	b) READ_SIZE=$OPTARG ;;
+	i) ITERATIONS=$OPTARG ;;
+	m) MODES=$OPTARG ;;
+	*) exit 1 ;;
+	esac
+done
+
+WORK=$(mktemp -d)
+loader=
+trap '[ -n "$loader" ] && kill -INT $loader 2>/dev/null; rm -rf $WORK' EXIT
+
+make -s all bench/reader
+
+# One file per reader, all with the same contents. day1 watches files by
+# inode, so they all have to be there before it starts
+python3 bench/gen_input.py gen --size $SIZE > $WORK/advent.0
+python3 bench/gen_input.py solve $WORK/advent.0 > $WORK/expected
+for ((r = 1; r < MAX_READERS; r++)); do
+	cp $WORK/advent.0 $WORK/advent.$r
+done
+bytes=$(stat -c %s $WORK/advent.0)
+
+COUNTS=
+for ((n = 1; n < MAX_READERS; n *= 2)); do
+	COUNTS="$COUNTS $n"
+done
+COUNTS="$COUNTS $MAX_READERS"
+
+now_ns() {
+	date +%s%N
+}
+
+# Start $1 readers together and wait for them all. Each one writes the time it
+# took for each of its reads to $WORK/times.<reader>, and this prints the wall
+# clock time for the lot
+run_readers() {
+	local n=$1 mode=$2 pids= start
+	rm -f $WORK/times.*
+	start=$(now_ns)
+	for ((r = 0; r < n; r++)); do
+		local file=$WORK/advent.$r
+		[ $mode = shared ] && file=$WORK/advent.0
+		(
+			for ((i = 0; i < ITERATIONS; i++)); do
+				t=$(now_ns)
+				bench/reader -b $READ_SIZE $file > /dev/null
+				echo $(($(now_ns) - t))
+			done > $WORK/times.$r
+		) &
+		pids="$pids $!"
+	done
+	wait $pids
+	echo $(($(now_ns) - start))
+}
+
+# Mean of all the per-read times from the last run_readers, in ms
+reader_ms() {
+	cat $WORK/times.* | awk '{ t += $1; n++ } END { printf "%.3f", n ? t / n / 1e6 : 0 }'
+}
+
+# The untraced times don't depend on the parser, so they're only measured once
+declare -A BASE
+for mode in $MODES; do
+	for n in $COUNTS; do
+		run_readers $n $mode > /dev/null
+		BASE[$mode.$n]=$(reader_ms)
+	done
+done
+
+printf "%-4s %-8s %7s %-3s %10s %10s %9s %9s %8s %8s\n" \
+	"PART" "MODE" "READERS" "OK" "MB/s" "READER_MS" "SLOWDOWN" "OVERHEAD" "DROPPED" "NO_SPACE"
+for part in $PARTS; do
+	# p1, p1s and p1b check against the part 1 answer, everything else against part 2
+	case $part in
+	p1*) answer=p1 ;;
+	*) answer=p2 ;;
+	esac
+	expected=$(awk -v a=$answer '{ for (i = 1; i < NF; i++) if ($i == a) print $(i + 1) }' $WORK/expected)
+
+	for mode in $MODES; do
+		one=
+		for n in $COUNTS; do
+			log=$WORK/day1.log
+			./day1 --parser $part --stats --file "$WORK/advent.*" > $log &
+			loader=$!
+			sleep 3
+
+			wall=$(run_readers $n $mode)
+			ms=$(reader_ms)
+			[ -z "$one" ] && one=$ms
+
+			# Give the last results time to come through the ring buffer
+			sleep 1
+			kill -INT $loader
+			wait $loader || true
+			loader=
+
+			# Result lines have the file name in column 4 and the total in
+			# column 5. The counters are printed every second, so the
+			# last no_space line is the final count
+			awk -v part=$part -v mode=$mode -v n=$n -v expected=$expected \
+				-v want=$((n * ITERATIONS)) -v bytes=$bytes \
+				-v wall=$wall -v ms=$ms -v one=$one -v base=${BASE[$mode.$n]} '
+				$4 ~ /^advent\.[0-9]+$/ && $2 ~ /^[0-9]+$/ {
+					results++
+					if ($5 != expected || NF > 5) bad++
+				}
+				$2 == "events" && $3 == "dropped" { dropped = $1 }
+				$1 == "no_space" { nospace = $2 }
+				END {
+					ok = (results == want && !bad) ? "yes" : "NO"
+					printf "%-4s %-8s %7d %-3s %10.1f %10.3f %9.2f %9.2f %8d %8d\n",
+						part, mode, n, ok, bytes * want * 1000 / wall, ms,
+						ms / one, base > 0 ? ms / base : 0, dropped, nospace
+				}' $log
+		done
+	done
+done
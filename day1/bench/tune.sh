@@ -0,0 +1,90 @@
+#!/bin/bash
+# Pick the chunk size (ADVENT_BUFFER_LEN) for each parser. For each candidate
+# size it rebuilds day1, checks that every parser loads with both
+# fentry/fexit and kprobes, and times each one with day1 --replay on
+# generated input. The fastest size that loaded for each parser goes into
+# day1buflen.h, which the next build picks up. Run as root from day1/ (or via
+# make tune).
+#
+#   bench/tune.sh [-p "p1 p2b"] [-b "4096 16384 65536 131072"] [-s 16M] [-n repeats]
+
+set -e
+cd "$(dirname "$0")/.."
+
+PARTS="p1 p1s p1b p2 p2a p2b"
+LENS="2048 4096 8192 16384 32768 65536 131072"
+SIZE=16M
+REPEAT=5
+OUT=day1buflen.h
+
+while getopts "p:b:s:n:" opt; do
+	case $opt in
+	p) PARTS=$OPTARG ;;
+	b) LENS=$OPTARG ;;
+	s) SIZE=$OPTARG ;;
+	n) REPEAT=$OPTARG ;;
+	*) exit 1 ;;
+	esac
+done
+
+# p1s and p1b read the chunk a word at a time, and the build refuses anything
+# else
+for len in $LENS; do
+	if ((len <= 0 || len % 8)); then
+		echo "Chunk sizes have to be multiples of 8: $len" >&2
+		exit 1
+	fi
+done
+
+WORK=$(mktemp -d)
+trap 'rm -rf $WORK' EXIT
+python3 bench/gen_input.py gen --size $SIZE > $WORK/input
+
+declare -A best_len best_ns
+
+printf "%-4s %8s %10s\n" "PART" "BUF_LEN" "NS/BYTE"
+for len in $LENS; do
+	# A size on the command line overrides day1buflen.h
+	rm -f day1.bpf.o day1.skel.h
+	make -s day1 BPF_CFLAGS=-DADVENT_BUFFER_LEN=$len
+	for part in $PARTS; do
+		# --load-stats prints the attach mode it loaded, and fails rather
+		# than falling back, so both modes really are checked
+		if ! ./day1 --parser $part --load-stats 2>&1 | grep -qx "MODE fentry/fexit" ||
+		   ! ./day1 --parser $part --load-stats --kprobes 2>&1 | grep -qx "MODE kprobes"; then
+			printf "%-4s %8s %10s\n" $part $len "FAILED"
+			continue
+		fi
+		ns=$(./day1 --parser $part --replay $WORK/input --chunk-size 131072 --repeat $REPEAT |
+			awk '/ns\/byte parsing/ { print $1 }')
+		printf "%-4s %8s %10s\n" $part $len $ns
+		if [ -n "$ns" ] && { [ -z "${best_ns[$part]}" ] ||
+		   awk -v a=$ns -v b=${best_ns[$part]} 'BEGIN { exit !(a < b) }'; }; then
+			best_ns[$part]=$ns
+			best_len[$part]=$len
+		fi
+	done
+done
+
+max=0
+{
+	echo "// Generated by bench/tune.sh (make tune) on $(uname -n), $(uname -r)."
+	echo "// The fastest chunk size for each parser that verified, from day1 --replay"
+	for part in $PARTS; do
+		len=${best_len[$part]}
+		[ -z "$len" ] && continue
+		echo "#define ADVENT_BUFFER_LEN_${part^^} $len	// ${best_ns[$part]} ns/byte"
+		[ $len -gt $max ] && max=$len
+	done
+	# The scratch buffer has to hold the biggest chunk
+	echo "#define ADVENT_BUFFER_LEN $max"
+} > $WORK/$OUT
+if [ $max -eq 0 ]; then
+	echo "No parser loaded at any size" >&2
+	exit 1
+fi
+mv $WORK/$OUT $OUT
+cat $OUT
+
+rm -f day1.bpf.o day1.skel.h
+make -s day1
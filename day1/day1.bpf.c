@@ -4,317 +4,1452 @@
 #include <bpf/bpf_core_read.h>
 #include "day1.h"
 
-#ifdef PART1
-#include "day1p1.bpf.c"
+// Not in vmlinux.h, which only has types
+#define EEXIST 17
+
+// Each chunk of the user's buffer is copied into this CPU's scratch space
+// before it's parsed. By default it's the same size as the buffer cat reads
+// into, so a whole read is copied in one go and each byte is only copied once.
+// make tune measures which chunk size suits each parser best and writes them
+// to day1buflen.h, unless ADVENT_BUFFER_LEN is set on the command line, which
+// sets the size for all of them
+#if !defined(ADVENT_BUFFER_LEN) && __has_include("day1buflen.h")
+#include "day1buflen.h"
 #endif
-#ifdef PART2
-#include "day1p2.bpf.c"
+
+#ifndef ADVENT_BUFFER_LEN
+#define ADVENT_BUFFER_LEN (128 * 1024)
 #endif
-#ifdef PART2A
-#include "day1p2a.bpf.c"
+
+#ifndef ADVENT_BUFFER_LEN_P1
+#define ADVENT_BUFFER_LEN_P1 ADVENT_BUFFER_LEN
+#endif
+#ifndef ADVENT_BUFFER_LEN_P1S
+#define ADVENT_BUFFER_LEN_P1S ADVENT_BUFFER_LEN
 #endif
+#ifndef ADVENT_BUFFER_LEN_P1B
+#define ADVENT_BUFFER_LEN_P1B ADVENT_BUFFER_LEN
+#endif
+#ifndef ADVENT_BUFFER_LEN_P2
+#define ADVENT_BUFFER_LEN_P2 ADVENT_BUFFER_LEN
+#endif
+#ifndef ADVENT_BUFFER_LEN_P2A
+#define ADVENT_BUFFER_LEN_P2A ADVENT_BUFFER_LEN
+#endif
+#ifndef ADVENT_BUFFER_LEN_P2B
+#define ADVENT_BUFFER_LEN_P2B ADVENT_BUFFER_LEN
+#endif
+
+// The scratch buffer is ADVENT_BUFFER_LEN, so no parser's chunks can be bigger
+#if ADVENT_BUFFER_LEN_P1 > ADVENT_BUFFER_LEN || ADVENT_BUFFER_LEN_P1S > ADVENT_BUFFER_LEN || \
+    ADVENT_BUFFER_LEN_P1B > ADVENT_BUFFER_LEN || ADVENT_BUFFER_LEN_P2 > ADVENT_BUFFER_LEN || ADVENT_BUFFER_LEN_P2A > ADVENT_BUFFER_LEN || \
+    ADVENT_BUFFER_LEN_P2B > ADVENT_BUFFER_LEN
+#error "a parser's chunk size is bigger than ADVENT_BUFFER_LEN"
+#endif
+
+// p1s and p1b read the scratch buffer a u64 at a time, and would quietly miss
+// the end of a chunk that isn't a whole number of them
+#if ADVENT_BUFFER_LEN % 8 != 0 || ADVENT_BUFFER_LEN_P1 % 8 != 0 || ADVENT_BUFFER_LEN_P1S % 8 != 0 || \
+    ADVENT_BUFFER_LEN_P1B % 8 != 0 || ADVENT_BUFFER_LEN_P2 % 8 != 0 || ADVENT_BUFFER_LEN_P2A % 8 != 0 || \
+    ADVENT_BUFFER_LEN_P2B % 8 != 0
+#error "chunk sizes have to be multiples of 8"
+#endif
+
+// The parsing state that carries on from one read to the next, shared by all
+// the parsers. Each one only uses the fields it needs. It's 32 bytes, so it
+// fits in a stream's first 64 bytes along with the offsets
+struct line_state {
+   // Running total 
+   u64 total;   
+   // Number of lines dealt with so far - only used for debugging
+   u32 lines;
+
+   // First & last digit in the line we're currently processing 
+   s8 first_digit;
+   s8 last_digit;
+
+   // current state in the number-parsing FSM
+   // Only used in p2a and p2b
+   char table_state;
+
+   // Set while parsing a read on its own (see summarise_read) until the first
+   // newline. The digits before that belong to a line that started in an
+   // earlier part of the file, so they're kept here instead of being added up
+   u8 head_open;
+   s8 head_first;
+   s8 head_last;
+
+   // How far through each digit word we are. Only used in p2
+   // text_digits[1] = 0 if no characters from 'one'
+   //            [1] = 1 if we found 'o'
+   //            [1] = 2 if we found 'o' followed by 'n'
+   s8 text_digits[10];
+};
+
+// What the parsers' bpf_loop callbacks get: the line state, and the chunk of
+// the file they're looking at
+struct advent_state {
+   struct line_state ls;
+
+   // Copy of a section of the file being read, in per-CPU scratch space
+   char *buffer;
+   // Number of bytes in buffer, for parsers that don't look at one character
+   // per callback
+   u32 length;
+
+   // For p1b, which moves through the chunk itself rather than by index:
+   // where it's got to, where the current line ends, how far back the
+   // backward scan can go, and which of the scans it's doing
+   u32 pos;
+   u32 line_end;
+   u32 stop;
+   u8 phase;
+};
+
+// Which parser to use. User space sets this before loading, so the verifier
+// knows its value and throws away the code for all the other parsers
+const volatile u32 parser = PARSER_P2;
+
+// Set by day1 --debug. bpf_printk() takes a lock and formats its message every
+// time, which is far too slow for the read path, so every trace message goes
+// through debug_printk() and the verifier drops them all when this is off
+const volatile bool debug = false;
 
-#define LOOPS 3
+#define debug_printk(fmt, ...)				\
+	do {						\
+		if (debug)				\
+			bpf_printk(fmt, ##__VA_ARGS__);	\
+	} while (0)
 
+// Every parser calls this when it sees a newline
+static __always_inline void end_line(struct advent_state *astate) {
+	if (astate->ls.head_open) {
+		astate->ls.head_first = astate->ls.first_digit;
+		astate->ls.head_last = astate->ls.last_digit;
+		astate->ls.head_open = 0;
+	} else if (astate->ls.first_digit >= 0) {
+		astate->ls.total = astate->ls.total + (astate->ls.first_digit * 10) + astate->ls.last_digit;
+	}
+	astate->ls.first_digit = -1;
+	astate->ls.last_digit = -1;
+	astate->ls.lines = astate->ls.lines + 1;
+}
+
+#include "day1p1.bpf.c"
+#include "day1p1s.bpf.c"
+#include "day1p1b.bpf.c"
+#include "day1p2.bpf.c"
+#include "day1p2a.bpf.c"
+#include "day1p2b.bpf.c"
+
+// A read being parsed. This is on the stack of the program doing the parsing
 struct buffer_t {
    char *buf;
-   u16 length;
-   u16 offset;
+   u64 length;
+   u64 offset;
    struct advent_state astate;
-   u8 depth;
+};
+
+// Scratch space that examine_char reads from
+struct scratch_t {
+   char data[ADVENT_BUFFER_LEN];
+   // Set while a program is parsing in data. It's 64 bits because a 32-bit
+   // compare and swap needs alu32 (-mcpu=v3), which we don't build with
+   u64 busy;
+};
+
+// Number of files we're currently tracking. Every read and close on the system
+// hits our probes, and nearly all of them have nothing to do with us, so when
+// this is zero they can return without touching any maps
+u32 active_files = 0;
+
+// A process can be reading more than one of the files we're interested in (for
+// example, cat advent.full advent.example)
+#define MAX_STREAMS 4
+
+// Digit words can be split across two reads, so we keep up to this many bytes
+// from each edge of a read to check for them when joining reads back up. It's
+// one less than the longest word, and has to be a power of 2
+#define EDGE_LEN (MAX_WORD_LEN - 1)
+
+// Everything we know about one file being read. A read in order only touches
+// the first 64 bytes (and bypassed, if it isn't all parsed). Task storage
+// doesn't put the value on a cache line boundary, so those can still straddle
+// two lines; the alignment only rounds the size up, so that every stream
+// starts at the same place in a line. The rest is only needed for reads out of
+// order and at open and close
+struct stream_t {
+   // The open file, or NULL if this slot is free
+   struct file *file;
+   // Where the reads in order have got to. Non-zero once there's been one
+   u64 next_offset;
+   // Bytes parsed, in order or not
+   u64 bytes;
+   // Parsing state for the part of the file that's been read in order, from
+   // the start up to next_offset
+   struct line_state ls;
+   // The last few bytes before next_offset, for the parsers that look for
+   // words. There are as many of them as next_offset allows, up to EDGE_LEN
+   char tail[EDGE_LEN];
+
+   // Number of reads that weren't in order, and have been summarised in the
+   // summaries map to be joined up when the file is closed
+   u32 summaries;
+   // Number of times the file was read some way we can't see the data for
+   // (splice, sendfile, copy_file_range, mmap), or read but not all parsed,
+   // so the result is short
+   u32 bypassed;
+   // bpf_ktime_get_ns() when the file was opened
+   u64 open_ns;
+   // For the result
+   char filename[DNAME_INLINE_LEN];
+   char task[TASK_COMM_LEN];
+} __attribute__((aligned(64)));
+
+struct task_streams_t {
+   struct stream_t streams[MAX_STREAMS];
+};
+
+// A read that the vfs_read kprobe has seen start, for the kretprobe to pick up
+struct pending_read_t {
+   // Slot + 1 of the stream being read. 0 means none
+   u32 slot;
+   char *buf;
+   // Where in the file the read starts
+   u64 offset;
+   u64 length;
+   // With trampolines, the file a vfs_read() is in progress for, so that the
+   // filemap_read hook underneath it leaves the read to fexit_read
+   struct file *in_read;
+   // With kprobes, the file the vfs_open kprobe set up a stream for, so that
+   // the kretprobe can give the slot back if the open fails
+   struct file *opening;
+};
+
+// A read at offset that didn't follow on from what had already been read. Its
+// lines are parsed on their own and reduced to this, which can be joined onto
+// whatever comes before it once that's known
+struct summary_key {
+   struct file *file;
+   u64 offset;
+};
+
+struct summary_t {
+   u64 length;
+   // Number of newlines, and total of the complete lines between the first
+   // and last of them
+   u64 total;
+   u32 lines;
+   // Digits before the first newline (all of them if there isn't one), which
+   // finish off a line from the previous read
+   s8 head_first;
+   s8 head_last;
+   // Digits after the last newline, which start a line that the next read
+   // finishes
+   s8 tail_first;
+   s8 tail_last;
+   // Raw bytes from each end, for finding words split across reads. Only
+   // filled in by parsers that look for words
+   u8 words;
+   u8 head_len;
+   u8 tail_len;
+   char head[EDGE_LEN];
+   char tail[EDGE_LEN];
 };
 
 // Maps
-// Start event is indexed by pid and stores the event we'll eventually send to
-// user space
+// Streams are stored with the process (its thread group leader) that opened
+// the file, so any of its threads can read the file, lookups don't contend
+// with other processes, and everything is freed when the process exits
 struct {
-	__uint(type, BPF_MAP_TYPE_HASH);
-	__uint(max_entries, 8192);
-	__type(key, u32);
-	__type(value, struct event);
-} start_event SEC(".maps");
+	__uint(type, BPF_MAP_TYPE_TASK_STORAGE);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, int);
+	__type(value, struct task_streams_t);
+} streams SEC(".maps");
 
-// Buffer is indexed by pid and holds information about the buffer that the file
-// is being read intos
+// The read each thread is in the middle of
+struct {
+	__uint(type, BPF_MAP_TYPE_TASK_STORAGE);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, int);
+	__type(value, struct pending_read_t);
+} reads SEC(".maps");
+
+// Summaries of out of order reads, waiting for the file to be closed
 struct {
 	__uint(type, BPF_MAP_TYPE_HASH);
-	__uint(max_entries, 8192);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__uint(max_entries, 65536);
+	__type(key, struct summary_key);
+	__type(value, struct summary_t);
+} summaries SEC(".maps");
+
+// One scratch buffer per CPU, so it doesn't have to live on the stack. This
+// is an ordinary array indexed by CPU rather than a per-CPU array, because
+// per-CPU values can't be bigger than 32k. User space sets max_entries to one
+// more than the highest CPU that's online when it loads, rather than the
+// number of possible CPUs, which can be far more
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
 	__type(key, u32);
-	__type(value, struct buffer_t);
-} buffer SEC(".maps");
+	__type(value, struct scratch_t);
+} scratch SEC(".maps");
 
-// Output events
+// Output events, shared by all CPUs
 struct {
-	__uint(type, BPF_MAP_TYPE_PERF_EVENT_ARRAY);
-	__uint(key_size, sizeof(u32));
-	__uint(value_size, sizeof(u32));
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, 256 * 1024);
 } events SEC(".maps");
 
-// Executables we are interested in 
+// Latest result for each file, keyed by inode. It's pinned (under
+// /sys/fs/bpf/day1) so anything can read it without going through the event
+// stream, and it's LRU so it never fills up if nothing is draining it
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, 10240);
+	__type(key, struct inode_key);
+	__type(value, struct result_t);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} results SEC(".maps");
+
+// Set by day1 --interval, which reads the results map in batches. There's no
+// need to send every result through the ring buffer as well
+const volatile bool batch_results = false;
+
+// Number of events that didn't fit in the ring buffer
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, u32);
+	__type(value, u64);
+} dropped_events SEC(".maps");
+
+// Hot path counters for day1 --stats, indexed by enum advent_counter
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, COUNTERS);
+	__type(key, u32);
+	__type(value, u64);
+} counters SEC(".maps");
+
+// Set by day1 --stats. When it's off the verifier drops all the counting
+const volatile bool collect_stats = false;
+
+// Histograms for day1 --histograms, HIST_SLOTS entries for each enum
+// advent_hist one after the other
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, HISTS * HIST_SLOTS);
+	__type(key, u32);
+	__type(value, u64);
+} hists SEC(".maps");
+
+// Set by day1 --histograms. Like collect_stats, the verifier drops the timing
+// and the histogram updates when it's off
+const volatile bool collect_hists = false;
+
+// Executables we are interested in. Only checked if filter_comm is set
 struct {
 	__uint(type, BPF_MAP_TYPE_HASH);
-    __uint(max_entries, 100);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__uint(max_entries, 100);
 	__type(key, struct executable_t);
 	__type(value, u32);
 } executables SEC(".maps");
 
-// Filenames we are interested in 
+// Files and directories we are interested in, by inode. User space works out
+// which they are from the paths it's given. The value is an enum target_kind
 struct {
 	__uint(type, BPF_MAP_TYPE_HASH);
-    __uint(max_entries, 100);
-	__type(key, struct filename_t);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__uint(max_entries, 1024);
+	__type(key, struct inode_key);
 	__type(value, u32);
-} filenames SEC(".maps");
+} targets SEC(".maps");
 
-// Tail calls
-#define DO_BUFFER_READ 0
+// Set by user space before loading: whether to check the executable, and
+// whether any of the targets are directories, which means looking up the
+// directories above a file that isn't a target itself
+const volatile bool filter_comm = true;
+const volatile bool watch_dirs = false;
 
-int buffer_read(struct pt_regs *ctx);
+// Only used by user space, to remember what a daemon was started with
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, u32);
+	__type(value, struct daemon_config);
+} config SEC(".maps");
 
+// Tail calls. These are only used when we're attached with kprobes, so user
+// space fills in the program array after loading. DO_BUFFER_READ holds the
+// buffer_read program for the parser in use, and swapping it for another one
+// switches parser without reloading anything
 struct {
 	__uint(type, BPF_MAP_TYPE_PROG_ARRAY);
     __uint(max_entries, 3);
 	__uint(key_size, sizeof(u32));
 	__uint(value_size, sizeof(u32));	
-	__array(values, int (void *));
-} tailcalls SEC(".maps") = {
-	.values = {
-		[DO_BUFFER_READ] = (void *)&buffer_read, 
-	},
-};
+} tailcalls SEC(".maps");
 
-// When a file is opened, if it's a filename and executable we're interested in,
-// create a start_event for this pid
-SEC("kprobe/vfs_open")
-int BPF_KPROBE(vfs_open, struct path *path, struct file *file)
+// Index of the highest bit set in v, or 0 if v is 0. This is the same
+// branch-free version the bcc tools use
+static __always_inline u32 log2_32(u32 v)
+{
+	u32 shift, r;
+
+	r = (v > 0xFFFF) << 4; v >>= r;
+	shift = (v > 0xFF) << 3; v >>= shift; r |= shift;
+	shift = (v > 0xF) << 2; v >>= shift; r |= shift;
+	shift = (v > 0x3) << 1; v >>= shift; r |= shift;
+	r |= (v >> 1);
+	return r;
+}
+
+static __always_inline u32 log2_64(u64 v)
+{
+	u32 hi = v >> 32;
+	return hi ? log2_32(hi) + 32 : log2_32(v);
+}
+
+// Count v in the right bucket of one of this CPU's histograms
+static __always_inline void add_hist(u32 hist, u64 v)
 {
-	struct event e = {};
-	e.pid = 0;
-	e.result = 0; 
-	for (u32 i=0; i<TASK_COMM_LEN; i++) {
-		e.task[i] = 0;
+	if (!collect_hists) {
+		return;
 	}
-	for (u32 i=0; i<DNAME_INLINE_LEN; i++) {
-		e.filename[i] = 0;
+	u32 slot = v ? log2_64(v) + 1 : 0;
+	if (slot >= HIST_SLOTS) {
+		slot = HIST_SLOTS - 1;
 	}
+	u32 key = hist * HIST_SLOTS + slot;
+	u64 *c = bpf_map_lookup_elem(&hists, &key);
+	if (c) {
+		*c += 1;
+	}
+}
 
-	bpf_get_current_comm(&e.task, sizeof(e.task));
-	if (!bpf_map_lookup_elem(&executables, &e.task)) {
-		// skip this executable
-		return 0;
+// Add n to one of the counters for this CPU. The counters are only ever
+// touched from this CPU, so they don't need atomics
+static __always_inline void add_count(u32 counter, u64 n)
+{
+	if (!collect_stats) {
+		return;
+	}
+	u64 *c = bpf_map_lookup_elem(&counters, &counter);
+	if (c) {
+		*c += n;
+	}
+}
+
+// Set up the parsing state for the first read of a file
+static __always_inline void init_state(struct line_state *ls) {
+	__builtin_memset(ls, 0, sizeof(*ls));
+	ls->first_digit = -1;
+	ls->last_digit = -1;
+	ls->head_first = -1;
+	ls->head_last = -1;
+}
+
+// Streams for the current process
+static __always_inline struct task_streams_t *process_streams(u64 flags)
+{
+	struct task_struct *leader = bpf_get_current_task_btf()->group_leader;
+	return bpf_task_storage_get(&streams, leader, 0, flags);
+}
+
+// Find the stream for this file in the current process, if there is one
+static __always_inline struct stream_t *find_stream(struct task_streams_t *ts, struct file *file)
+{
+	for (u32 i = 0; i < MAX_STREAMS; i++) {
+		if (ts->streams[i].file == file) {
+			return &ts->streams[i];
+		}
 	}
+	return NULL;
+}
+
+static __always_inline struct stream_t *current_stream(struct file *file)
+{
+	struct task_streams_t *ts = process_streams(0);
+	if (!ts) {
+		return NULL;
+	}
+	return find_stream(ts, file);
+}
 
+static __always_inline void get_inode_key(struct inode *inode, struct inode_key *key)
+{
+	key->ino = BPF_CORE_READ(inode, i_ino);
+	key->dev = BPF_CORE_READ(inode, i_sb, s_dev);
+}
+
+// Whether the file at dentry is one of the targets, or is below a target
+// directory
+static __always_inline bool is_target(struct dentry *dentry)
+{
+	struct inode_key key = {};
+	get_inode_key(BPF_CORE_READ(dentry, d_inode), &key);
+	if (bpf_map_lookup_elem(&targets, &key)) {
+		return true;
+	}
+	if (!watch_dirs) {
+		return false;
+	}
+
+	for (u32 i = 0; i < MAX_DIR_DEPTH; i++) {
+		struct dentry *parent = BPF_CORE_READ(dentry, d_parent);
+		// The root of the filesystem is its own parent
+		if (!parent || parent == dentry) {
+			return false;
+		}
+		dentry = parent;
+		get_inode_key(BPF_CORE_READ(dentry, d_inode), &key);
+		u32 *kind = bpf_map_lookup_elem(&targets, &key);
+		if (kind && *kind == TARGET_DIR) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Give a stream's slot back
+static __always_inline void free_stream(struct stream_t *st)
+{
+	st->file = NULL;
+	__sync_fetch_and_sub(&active_files, 1);
+}
+
+// When a file is opened, if it's a file and executable we're interested in,
+// create a stream for it in this process. The file isn't filled in until
+// vfs_open() runs, so we go by the path. Returns whether there's a stream for
+// the file, which has to be given back with free_stream() if the open fails
+static __always_inline bool do_vfs_open(struct path *path, struct file *file)
+{
 	struct dentry *dentry = BPF_CORE_READ(path, dentry);
-	bpf_probe_read_kernel_str(&e.filename, sizeof(e.filename), &dentry->d_iname);
-	if (!bpf_map_lookup_elem(&filenames, &e.filename)) {
+	if (!is_target(dentry)) {
 		// skip file we're not interested in
+		add_count(COUNT_OPEN_REJECT, 1);
+		return false;
+	}
+
+	struct executable_t exe = {};
+	bpf_get_current_comm(&exe.name, sizeof(exe.name));
+	if (filter_comm && !bpf_map_lookup_elem(&executables, &exe)) {
+		// skip this executable
+		add_count(COUNT_OPEN_REJECT, 1);
+		return false;
+	}
+	add_count(COUNT_OPEN_MATCH, 1);
+
+	struct task_streams_t *ts = process_streams(BPF_LOCAL_STORAGE_GET_F_CREATE);
+	if (!ts) {
+		debug_printk("vfs_open: error getting task storage");
+		add_count(COUNT_NO_SPACE, 1);
+		return false;
+	}
+
+	struct stream_t *st = find_stream(ts, file);
+	if (!st) {
+		st = find_stream(ts, NULL);
+		if (!st) {
+			debug_printk("vfs_open: too many files open for %s", &exe.name);
+			add_count(COUNT_NO_SPACE, 1);
+			return false;
+		}
+		__sync_fetch_and_add(&active_files, 1);
+	}
+
+	st->file = file;
+	st->next_offset = 0;
+	st->bytes = 0;
+	init_state(&st->ls);
+	st->summaries = 0;
+	st->bypassed = 0;
+	st->open_ns = bpf_ktime_get_ns();
+	__builtin_memcpy(st->task, exe.name, sizeof(st->task));
+	// The name is only for showing in the results. Names longer than the
+	// space we have for them get cut short
+	bpf_probe_read_kernel_str(st->filename, sizeof(st->filename), BPF_CORE_READ(dentry, d_name.name));
+
+	debug_printk("vfs_open: file %s found by command %s", st->filename, st->task);
+	return true;
+}
+
+// The kprobe sets the stream up before vfs_open() has run, and the kretprobe
+// gives it back if the open failed, as filp_close() will never be called for it
+SEC("kprobe/vfs_open")
+int BPF_KPROBE(vfs_open, struct path *path, struct file *file)
+{
+	if (!do_vfs_open(path, file)) {
 		return 0;
 	}
+	struct pending_read_t *pr = bpf_task_storage_get(&reads, bpf_get_current_task_btf(), 0, BPF_LOCAL_STORAGE_GET_F_CREATE);
+	if (pr) {
+		pr->opening = file;
+	}
+	return 0;
+}
 
-	u32 pid = (u32) bpf_get_current_pid_tgid();
-	long err = bpf_map_update_elem(&start_event, &pid, &e, 0);
-	if (err) {
-		bpf_printk("vfs_open: error updating start_event map");
+SEC("kretprobe/vfs_open")
+int BPF_KRETPROBE(vfs_open_ret, int ret)
+{
+	if (!active_files) {
+		return 0;
+	}
+
+	struct pending_read_t *pr = bpf_task_storage_get(&reads, bpf_get_current_task_btf(), 0, 0);
+	if (!pr || !pr->opening) {
+		return 0;
+	}
+	struct file *file = pr->opening;
+	pr->opening = NULL;
+	if (ret) {
+		struct stream_t *st = current_stream(file);
+		if (st) {
+			free_stream(st);
+		}
 	}
+	return 0;
+}
 
-	bpf_printk("vfs_open: file %s found by command %s pid %d", &e.filename, &e.task, pid);
+// With trampolines there's no need to undo anything: the stream is only set up
+// once the open has worked
+SEC("fexit/vfs_open")
+int BPF_PROG(fexit_open, struct path *path, struct file *file, int ret)
+{
+	if (ret) {
+		return 0;
+	}
+	do_vfs_open(path, file);
 	return 0;
 }
 
-// When a file is closed, delete any map entries related to this pid if there
-// are any
-SEC("kprobe/filp_close")
-int BPF_KPROBE(filp_close, struct file *file) 
+// Keep the last EDGE_LEN bytes of edge followed by the n bytes in more
+static __always_inline void push_edge(char *edge, u8 *edge_len, const char *more, u32 n)
 {
-	u32 pid = (u32) bpf_get_current_pid_tgid();
-	struct event *e = bpf_map_lookup_elem(&start_event, &pid); 
-	if (e) {
-		struct buffer_t *b = bpf_map_lookup_elem(&buffer, &pid); 
-		if (b) {
-			e->result = b->astate.total;
-			e->pid = pid;
-			bpf_printk("filp_close: total is %d for pid %d, filename %s", e->result, pid, e->filename);
-			bpf_perf_event_output(ctx, &events, BPF_F_CURRENT_CPU, e, sizeof(struct event));
-			bpf_map_delete_elem(&buffer, &pid);
-		} else {
-			bpf_printk("filp_close: missing buffer for pid %d", pid);
+	for (u32 i = 0; i < EDGE_LEN; i++) {
+		if (i >= n) {
+			break;
+		}
+		if (*edge_len >= EDGE_LEN) {
+			for (u32 j = 0; j < EDGE_LEN - 1; j++) {
+				edge[j] = edge[j + 1];
+			}
+			*edge_len = EDGE_LEN - 1;
 		}
-		bpf_printk("filp_close: removing start event and buffer for pid %d", pid);
-		long err = bpf_map_delete_elem(&start_event, &pid);
-		if (err != 0) {
-			bpf_printk("filp_close: failed to delete start_event for pid %d", pid);
+		edge[*edge_len & (EDGE_LEN - 1)] = more[i];
+		*edge_len = *edge_len + 1;
+	}
+}
+
+// How many bytes of a stream's tail are filled in, once the reads in order
+// have got to next_offset
+static __always_inline u8 tail_len(u64 next_offset)
+{
+	return next_offset < EDGE_LEN ? next_offset : EDGE_LEN;
+}
+
+// Where we've got to joining up the reads of a file
+struct merge_t {
+   u64 total;
+   u32 lines;
+   // Digits in the line that's still open
+   s8 first_digit;
+   s8 last_digit;
+   u8 words;
+   u8 tail_len;
+   char tail[EDGE_LEN];
+};
+
+struct merge_ctx {
+   struct summary_key key;
+   struct merge_t m;
+   u32 merged;
+};
+
+static __always_inline void merge_digits(struct merge_t *m, s8 first, s8 last)
+{
+	if (first < 0) {
+		return;
+	}
+	if (m->first_digit < 0) {
+		m->first_digit = first;
+	}
+	m->last_digit = last;
+}
+
+// Find any digit word that starts in the bytes we have from the end of the
+// previous read and finishes in the head of this one. Neither read could see
+// it on its own. The dense table (see day1p2b.bpf.c) does the matching
+static __always_inline void merge_split_words(struct merge_t *m, struct summary_t *s)
+{
+	char window[2 * EDGE_LEN] = {};
+	u32 n = 0;
+	for (u32 i = 0; i < EDGE_LEN; i++) {
+		if (i < m->tail_len) {
+			window[n++ & (2 * EDGE_LEN - 1)] = m->tail[i];
 		}
-#ifdef PART2
-		err = bpf_map_delete_elem(&digit_state, &pid);
-		if (err != 0) {
-			bpf_printk("filp_close: failed to delete digit_state for pid %d", pid);
+	}
+	for (u32 i = 0; i < EDGE_LEN; i++) {
+		if (i < s->head_len) {
+			window[n++ & (2 * EDGE_LEN - 1)] = s->head[i];
 		}
-#endif
-	} 
+	}
+
+	u8 state = 0;
+	for (u32 i = 0; i < 2 * EDGE_LEN; i++) {
+		if (i >= n) {
+			break;
+		}
+		u8 c = window[i];
+		u32 t = state * FSM_INPUTS + c;
+		if (t >= FSM_STATES * FSM_INPUTS) {
+			t = c;
+		}
+		u8 out = dense_table[t].output;
+		u8 len = dense_table[t].length;
+		state = dense_table[t].new_state;
+		// A word ending at i started before the join if i - len + 1 < tail_len
+		if (out > 0 && out < 10 && i >= m->tail_len && i + 1 < m->tail_len + len) {
+			merge_digits(m, out, out);
+		}
+	}
+}
+
+// Join the read summarised in s onto the end of what's been merged so far
+static __always_inline void merge_summary(struct merge_t *m, struct summary_t *s)
+{
+	if (m->words && s->words) {
+		merge_split_words(m, s);
+	}
+	merge_digits(m, s->head_first, s->head_last);
+
+	if (s->lines) {
+		// The open line ends at the first newline in this read
+		if (m->first_digit >= 0) {
+			m->total += (m->first_digit * 10) + m->last_digit;
+		}
+		m->total += s->total;
+		m->lines += s->lines;
+		m->first_digit = s->tail_first;
+		m->last_digit = s->tail_last;
+	}
+
+	if (s->length >= EDGE_LEN) {
+		__builtin_memcpy(m->tail, s->tail, EDGE_LEN);
+		m->tail_len = s->tail_len;
+	} else {
+		// A very short read: its head is all of it
+		push_edge(m->tail, &m->tail_len, s->head, s->head_len);
+	}
+	m->words = s->words;
+}
+
+// Called by bpf_loop to join on the summary for the read that starts where the
+// last one finished, until there isn't one
+static long merge_next(u32 index, struct merge_ctx *ctx)
+{
+	struct summary_t *s = bpf_map_lookup_elem(&summaries, &ctx->key);
+	if (!s) {
+		return 1;
+	}
+
+	struct summary_key key = ctx->key;
+	merge_summary(&ctx->m, s);
+	ctx->key.offset += s->length;
+	bpf_map_delete_elem(&summaries, &key);
+	ctx->merged++;
+	return 0;
+}
+
+// Called by bpf_for_each_map_elem to throw away summaries for a file that
+// couldn't be joined up with the rest of it
+static long drop_summary(void *map, struct summary_key *key, struct summary_t *s, struct file *file)
+{
+	if (key->file == file) {
+		bpf_map_delete_elem(map, key);
+	}
+	return 0;
+}
+
+// Work out the final result for a stream, joining on any reads that were
+// summarised. Returns the number of summaries that couldn't be joined on
+static __always_inline u32 merge_stream(struct stream_t *st, u64 *total, u64 *lines)
+{
+	*total = st->ls.total;
+	*lines = st->ls.lines;
+	if (!st->summaries) {
+		return 0;
+	}
+
+	struct merge_ctx ctx = {};
+	ctx.key.file = st->file;
+	ctx.key.offset = st->next_offset;
+	ctx.m.total = st->ls.total;
+	ctx.m.lines = st->ls.lines;
+	ctx.m.first_digit = st->ls.first_digit;
+	ctx.m.last_digit = st->ls.last_digit;
+	// tail is only filled in by the parsers that look for words, but zeroes
+	// can't be part of a word, so it's safe to join on as it is either way
+	ctx.m.words = st->next_offset != 0;
+	ctx.m.tail_len = tail_len(st->next_offset);
+	__builtin_memcpy(ctx.m.tail, st->tail, EDGE_LEN);
+
+	bpf_loop(st->summaries, merge_next, &ctx, 0);
+	*total = ctx.m.total;
+	*lines = ctx.m.lines;
 
+	u32 unmerged = st->summaries - ctx.merged;
+	if (unmerged) {
+		debug_printk("filp_close: %d reads left over after merging %d", unmerged, ctx.merged);
+		bpf_for_each_map_elem(&summaries, drop_summary, st->file, 0);
+	}
+	return unmerged;
+}
+
+// Store the result against the file's inode, replacing the one from the last
+// time it was read
+static __always_inline void record_result(struct file *file, struct result_t *r)
+{
+	struct inode_key key = {};
+	get_inode_key(BPF_CORE_READ(file, f_inode), &key);
+
+	// Two readers closing the same file at once could both count 1 here,
+	// which doesn't matter for a count that's only for information
+	r->closes = 1;
+	struct result_t *old = bpf_map_lookup_elem(&results, &key);
+	if (old) {
+		r->closes = old->closes + 1;
+	}
+	bpf_map_update_elem(&results, &key, r, BPF_ANY);
+}
+
+static __always_inline void send_event(struct result_t *r)
+{
+	struct event *out = bpf_ringbuf_reserve(&events, sizeof(struct event), 0);
+	if (!out) {
+		u32 zero = 0;
+		u64 *dropped = bpf_map_lookup_elem(&dropped_events, &zero);
+		if (dropped) {
+			__sync_fetch_and_add(dropped, 1);
+		}
+		return;
+	}
+
+	__builtin_memcpy(out->filename, r->filename, sizeof(out->filename));
+	__builtin_memcpy(out->task, r->task, sizeof(out->task));
+	out->result = r->result;
+	out->unmerged = r->unmerged;
+	out->bypassed = r->bypassed;
+	out->pid = r->pid;
+	out->close_ns = r->close_ns;
+	bpf_ringbuf_submit(out, 0);
+}
+
+// When a file is closed, record the result for its stream if it has one, and
+// free up the slot
+static __always_inline int do_filp_close(struct file *file)
+{
+	if (!active_files) {
+		return 0;
+	}
+
+	struct stream_t *st = current_stream(file);
+	if (!st) {
+		return 0;
+	}
+
+	u32 pid = (u32) bpf_get_current_pid_tgid();
+	u64 now = bpf_ktime_get_ns();
+	add_hist(HIST_OPEN_NS, now - st->open_ns);
+	if (st->next_offset || st->summaries || st->bypassed) {
+		struct result_t r = {};
+		r.unmerged = merge_stream(st, &r.result, &r.lines);
+		r.bytes = st->bytes;
+		r.bypassed = st->bypassed;
+		r.pid = pid;
+		r.close_ns = now;
+		__builtin_memcpy(r.filename, st->filename, sizeof(r.filename));
+		__builtin_memcpy(r.task, st->task, sizeof(r.task));
+		debug_printk("filp_close: total is %d for pid %d, filename %s", r.result, pid, st->filename);
+		record_result(file, &r);
+		if (!batch_results) {
+			send_event(&r);
+		}
+	} else {
+		debug_printk("filp_close: missing buffer for pid %d", pid);
+		add_count(COUNT_NO_DATA, 1);
+	}
+
+	debug_printk("filp_close: removing stream for pid %d", pid);
+	free_stream(st);
 	return 0;
 }
 
-// When a file is read, check whether it's one we have a start_event for, and if
-// we do, initialize an entry in the buffer map. We'll actually look at the
-// buffer contents when the read completes using the corresponding kretprobe
+SEC("kprobe/filp_close")
+int BPF_KPROBE(filp_close, struct file *file) 
+{
+	return do_filp_close(file);
+}
+
+SEC("fentry/filp_close")
+int BPF_PROG(fentry_close, struct file *file)
+{
+	return do_filp_close(file);
+}
+
+// When a file is read, check whether it's one we have a stream for, and if we
+// do, record where the buffer is and where in the file the read starts. We'll
+// actually look at the buffer contents when the read completes using the
+// corresponding kretprobe
 SEC("kprobe/vfs_read")
 int BPF_KPROBE(vfs_read, struct file *file, char *buf, size_t count, loff_t *pos)
 {
-	long err;
-	u32 pid = (u32) bpf_get_current_pid_tgid();
-	struct event *e = bpf_map_lookup_elem(&start_event, &pid);
-	if (!e) {
-		// Not a file read we are interested in
+	if (!active_files) {
+		return 0;
+	}
+
+	struct task_streams_t *ts = process_streams(0);
+	if (!ts) {
 		return 0;
 	}
 
-	bpf_printk("vfs_read: pid %d, filename %s, task %s", pid, e->filename, e->task);
+	for (u32 i = 0; i < MAX_STREAMS; i++) {
+		struct stream_t *st = &ts->streams[i];
+		if (st->file == file) {
+			debug_printk("vfs_read: filename %s, task %s", st->filename, st->task);
+			struct pending_read_t *pr = bpf_task_storage_get(&reads, bpf_get_current_task_btf(), 0, BPF_LOCAL_STORAGE_GET_F_CREATE);
+			if (!pr) {
+				return 0;
+			}
+			pr->slot = i + 1;
+			pr->buf = buf;
+			pr->length = count;
+			pr->offset = st->next_offset;
+			if (pos) {
+				bpf_probe_read_kernel(&pr->offset, sizeof(pr->offset), pos);
+			}
+			return 0;
+		}
+	}
+
+	// Not a file read we are interested in
+   return 0;
+}
+
+// Copy the next chunk of the buffer into scratch space and run the parser's
+// callback over it, once for every bytes_per_loop bytes. A bytes_per_loop of
+// zero is for p1b, whose callback moves through the chunk at its own pace and
+// stops when it gets to the end. chunk_len is the parser's chunk size
+static __always_inline long read_chunk(struct buffer_t *bb, void *examine, u32 bytes_per_loop, u32 chunk_len) {
+	if (bb->offset >= bb->length) {
+		return 1;
+	}
+
+	u64 remaining = bb->length - bb->offset;
+	u32 read_length = chunk_len;
+	if (remaining < chunk_len) {
+		read_length = remaining;
+	}
+
+	long err = bpf_probe_read_user(bb->astate.buffer, read_length, bb->buf + bb->offset);
+	if (err) {
+		debug_printk("read_chunk: failed to read %d chars at offset %d", read_length, bb->offset);
+		add_count(COUNT_READ_FAILS, 1);
+		return 1;
+	}
+
+	// The last callback may get a partly filled word
+	bb->astate.length = read_length;
+	u32 loops = bytes_per_loop ? (read_length + bytes_per_loop - 1) / bytes_per_loop : P1B_LOOPS(read_length);
+	long ii = bpf_loop(loops, examine, &bb->astate, 0);
+	if (bytes_per_loop ? ii != loops : bb->astate.pos != read_length) {
+		debug_printk("read_chunk: surprise! %d loops != %d for read_length %d", ii, loops, read_length);
+		add_count(COUNT_SHORT_LOOPS, 1);
+	}
+	bb->offset += read_length;
+	add_count(COUNT_CHUNKS, 1);
+	add_count(COUNT_BYTES, read_length);
+	return 0;
+}
+
+// Called by bpf_loop for each chunk of the buffer, one for each parser
+static long read_chunk_p1(u32 index, struct buffer_t *bb) {
+	return read_chunk(bb, examine_char_p1, 1, ADVENT_BUFFER_LEN_P1);
+}
+
+static long read_chunk_p1s(u32 index, struct buffer_t *bb) {
+	return read_chunk(bb, examine_word_p1s, sizeof(u64), ADVENT_BUFFER_LEN_P1S);
+}
+
+static long read_chunk_p1b(u32 index, struct buffer_t *bb) {
+	return read_chunk(bb, examine_line_p1b, 0, ADVENT_BUFFER_LEN_P1B);
+}
+
+static long read_chunk_p2(u32 index, struct buffer_t *bb) {
+	return read_chunk(bb, examine_char_p2, 1, ADVENT_BUFFER_LEN_P2);
+}
+
+static long read_chunk_p2a(u32 index, struct buffer_t *bb) {
+	return read_chunk(bb, examine_char_p2a, 1, ADVENT_BUFFER_LEN_P2A);
+}
+
+static long read_chunk_p2b(u32 index, struct buffer_t *bb) {
+	return read_chunk(bb, examine_char_p2b, 1, ADVENT_BUFFER_LEN_P2B);
+}
+
+// Number of chunk_len chunks left to parse in b
+static __always_inline u32 chunk_count(struct buffer_t *b, u32 chunk_len)
+{
+	return (b->length - b->offset + chunk_len - 1) / chunk_len;
+}
+
+// Parse the length bytes at buf, a chunk at a time, carrying on from the state
+// in ls and updating it. Returns how many bytes were parsed. which is either a
+// constant or the parser knob, so only one of the bpf_loop calls survives
+// verification
+static __always_inline u64 parse_buffer(char *buf, u64 length, struct line_state *ls, u32 which)
+{
+	// Our programs can't migrate to another CPU while they're running, but
+	// fentry/fexit programs can be preempted, and a task that runs on this
+	// CPU in the meantime can get here too. Only one of them can have the
+	// scratch buffer, and the other gives up on its read. A CPU that came
+	// online after we were loaded has no scratch buffer at all
+	u32 cpu = bpf_get_smp_processor_id();
+	struct scratch_t *s = bpf_map_lookup_elem(&scratch, &cpu);
+	if (!s || __sync_val_compare_and_swap(&s->busy, 0, 1)) {
+		add_count(COUNT_NO_SCRATCH, 1);
+		return 0;
+	}
+
+	// Can't call bpf_loop with memory from a map, so the state is copied
+	// onto the stack and back, 32 bytes each way
 	struct buffer_t bb = {};
 	bb.buf = buf;
+	bb.length = length;
 	bb.offset = 0;
-	bb.length = count; 
-	bb.depth = 0;
+	bb.astate.buffer = s->data;
+	bb.astate.ls = *ls;
+
+	debug_printk("parse_buffer: length %d from %x", bb.length, bb.buf);
+	add_count(COUNT_READS, 1);
+	switch (which) {
+	case PARSER_P1:
+		bpf_loop(chunk_count(&bb, ADVENT_BUFFER_LEN_P1), read_chunk_p1, &bb, 0);
+		break;
+	case PARSER_P1S:
+		bpf_loop(chunk_count(&bb, ADVENT_BUFFER_LEN_P1S), read_chunk_p1s, &bb, 0);
+		break;
+	case PARSER_P1B:
+		bpf_loop(chunk_count(&bb, ADVENT_BUFFER_LEN_P1B), read_chunk_p1b, &bb, 0);
+		break;
+	case PARSER_P2:
+		bpf_loop(chunk_count(&bb, ADVENT_BUFFER_LEN_P2), read_chunk_p2, &bb, 0);
+		break;
+	case PARSER_P2A:
+		bpf_loop(chunk_count(&bb, ADVENT_BUFFER_LEN_P2A), read_chunk_p2a, &bb, 0);
+		break;
+	case PARSER_P2B:
+		bpf_loop(chunk_count(&bb, ADVENT_BUFFER_LEN_P2B), read_chunk_p2b, &bb, 0);
+		break;
+	}
+
+	s->busy = 0;
+	*ls = bb.astate.ls;
+	debug_printk("parse_buffer: parsed %d of %d chars, total so far is %d", bb.offset, length, ls->total);
+	return bb.offset;
+}
 
-	struct buffer_t *b;
+// Parse a read that doesn't follow on from what's been read so far on its own,
+// and store a summary of it to be joined up with the rest of the file when
+// it's closed
+static __always_inline void summarise_read(struct stream_t *st, char *buf, u64 length, u64 offset, u32 which)
+{
+	struct line_state ls;
+	init_state(&ls);
+	ls.head_open = 1;
+	if (parse_buffer(buf, length, &ls, which) != length) {
+		__sync_fetch_and_add(&st->bypassed, 1);
+		return;
+	}
 
-	b = bpf_map_lookup_elem(&buffer, &pid);
-	if (b) {
-		bb.astate.first_digit = b->astate.first_digit;
-		bb.astate.last_digit = b->astate.last_digit;
-		bb.astate.total = b->astate.total;
-		bb.astate.lines = b->astate.lines;
+	struct summary_t s = {};
+	s.length = length;
+	s.total = ls.total;
+	s.lines = ls.lines;
+	if (ls.head_open) {
+		s.head_first = ls.first_digit;
+		s.head_last = ls.last_digit;
+		s.tail_first = -1;
+		s.tail_last = -1;
 	} else {
-		bpf_printk("vfs_read: first read for pid %d", pid);
-		bb.astate.first_digit = -1;
-		bb.astate.last_digit = -1;
-		bb.astate.total = 0;
-		bb.astate.lines = 0;
-
-#ifdef PART2A		
-		bb.astate.table_state = 0;
-#endif
-#ifdef PART2
-		bb.astate.pid = pid;
-		struct digit_state_t ds = {}; 
-		for (u8 i = 0; i < 10; i++) {
-			ds.text_digits[i] = 0;
-		}
-		err = bpf_map_update_elem(&digit_state, &pid, &ds, 0);
-		if (err) {
-			bpf_printk("vfs_read: error updating digit_state");
-		}
-#endif 
+		s.head_first = ls.head_first;
+		s.head_last = ls.head_last;
+		s.tail_first = ls.first_digit;
+		s.tail_last = ls.last_digit;
 	}
 
-	bpf_printk("vfs_read: buf %x with size %d, total so far %d for pid %d", buf, count, bb.astate.total, pid);
-	err = bpf_map_update_elem(&buffer, &pid, &bb, 0);
-	if (err) {
-		bpf_printk("vfs_read: error updating buffer");
+	if (which >= PARSER_P2) {
+		u32 n = length < EDGE_LEN ? length : EDGE_LEN;
+		s.words = 1;
+		s.head_len = n;
+		s.tail_len = n;
+		bpf_probe_read_user(s.head, n, buf);
+		bpf_probe_read_user(s.tail, n, buf + length - n);
 	}
 
-   return 0;
+	struct summary_key key = {};
+	key.file = st->file;
+	key.offset = offset;
+	long err = bpf_map_update_elem(&summaries, &key, &s, BPF_NOEXIST);
+	if (!err) {
+		__sync_fetch_and_add(&st->summaries, 1);
+	} else if (err == -EEXIST) {
+		// The same part of the file read again
+		bpf_map_update_elem(&summaries, &key, &s, BPF_EXIST);
+	} else {
+		// The map is full, so this read is lost. Count it as bypassed
+		// so the result is flagged as short rather than quietly wrong
+		add_count(COUNT_NO_SPACE, 1);
+		__sync_fetch_and_add(&st->bypassed, 1);
+	}
 }
 
+// Record how long a read took to parse, given when it started, and its size
+static __always_inline void hist_read(u64 start, u64 length)
+{
+	if (!collect_hists) {
+		return;
+	}
+	u64 ns = bpf_ktime_get_ns() - start;
+	add_hist(HIST_PARSE_NS, ns);
+	add_hist(HIST_READ_BYTES, length);
+	if (length) {
+		add_hist(HIST_PS_PER_BYTE, ns * 1000 / length);
+	}
+}
 
-// Tail call for parsing each character in the buffer
-SEC("kprobe")
-int buffer_read(struct pt_regs *ctx) {
-	u32 pid = (u32) bpf_get_current_pid_tgid();
-	struct buffer_t *b = bpf_map_lookup_elem(&buffer, &pid); 
-	if (!b) {
-		bpf_printk("buffer_read: no buffer state for pid %d", pid);		
-		return 0;
+// Parse a read of length bytes into buf, from offset in the file. A read is in
+// order if it starts where the last one ended, however it was made. ksys_read()
+// hands vfs_read() a copy of the file position on its own stack, so the pos
+// pointer can't tell read() from pread() anyway
+static __always_inline void handle_read(struct stream_t *st, char *buf, u64 length, u64 offset, u32 which)
+{
+	u64 start = collect_hists ? bpf_ktime_get_ns() : 0;
+	__sync_fetch_and_add(&st->bytes, length);
+	if (offset != st->next_offset) {
+		debug_printk("handle_read: %d bytes at %d out of order", length, offset);
+		summarise_read(st, buf, length, offset, which);
+		hist_read(start, length);
+		return;
 	}
 
-	// Can't call bpf_loop with memory from a map, so we need to take a copy 
-	struct advent_state astate = {};
-	astate.first_digit = b->astate.first_digit;
-	astate.last_digit = b->astate.last_digit;
-	astate.total = b->astate.total;
-	astate.lines = b->astate.lines;
-#ifdef PART2A
-	astate.table_state = b->astate.table_state;
-#endif
-#ifdef PART2
-	astate.pid = pid;
-#endif
-	
-	char *location;
-
-	for (u8 j = 0; (j < LOOPS) && (b->offset < b->length); j++) {
-		location = b->buf + b->offset;
-		u32 read_length = b->length - b->offset; 
-		if (read_length > ADVENT_BUFFER_LEN) {
-			read_length = ADVENT_BUFFER_LEN;
-		}
-		bpf_printk("buffer_read: length %d, offset %d from %x, read %d chars", b->length, b->offset, b->buf, read_length);
-		bpf_probe_read_user(astate.buffer, read_length, location);
-		long ii = bpf_loop(read_length, examine_char, &astate, 0);
-		if (ii != read_length) {
-			bpf_printk("buffer_read: surprise! %d loops != read_length %d");
-		}
-		b->offset += ADVENT_BUFFER_LEN;
+	if (parse_buffer(buf, length, &st->ls, which) != length) {
+		// Carry on from the end of the read anyway, so the reads after it
+		// still join up, but the result is short
+		__sync_fetch_and_add(&st->bypassed, 1);
 	}
 
-	b->astate.first_digit = astate.first_digit;
-	b->astate.last_digit = astate.last_digit;
-	b->astate.total = astate.total;
-	b->astate.lines = astate.lines;
-#ifdef PART2A
-	b->astate.table_state = astate.table_state;
-#endif
-	b->depth = b->depth + 1; 
-	bpf_map_update_elem(&buffer, &pid, b, 0);	
+	// Keep the end of the file so far in case the next read is out of order
+	// and starts with the end of a word
+	if (which >= PARSER_P2) {
+		char last[EDGE_LEN] = {};
+		u32 n = length < EDGE_LEN ? length : EDGE_LEN;
+		u8 len = tail_len(offset);
+		bpf_probe_read_user(last, n, buf + length - n);
+		push_edge(st->tail, &len, last, n);
+	}
+	st->next_offset = offset + length;
+	hist_read(start, length);
+}
 
-	if (b->length > b->offset) {		
-		bpf_printk("buffer_read: %d bytes left, total so far is %d, depth %d", b->length - b->offset, b->astate.total, b->depth);
-		bpf_tail_call(ctx, &tailcalls, DO_BUFFER_READ);
+// Tail call for parsing the buffer when we're using kprobes
+static __always_inline int do_buffer_read(u32 which) {
+	struct pending_read_t *pr = bpf_task_storage_get(&reads, bpf_get_current_task_btf(), 0, 0);
+	if (!pr) {
+		return 0;
 	}
+	u32 slot = pr->slot;
+	pr->slot = 0;
+	add_count(COUNT_TAIL_CALLS, 1);
+
+	struct task_streams_t *ts = process_streams(0);
+	if (!ts || slot == 0 || slot > MAX_STREAMS) {
+		debug_printk("buffer_read: no buffer state");
+		return 0;
+	}
+
+	handle_read(&ts->streams[slot - 1], pr->buf, pr->length, pr->offset, which);
 	return 0;
 }
 
+// One of these for each parser. User space puts the one it wants in the
+// tailcalls map
+SEC("kprobe")
+int buffer_read_p1(struct pt_regs *ctx) {
+	return do_buffer_read(PARSER_P1);
+}
+
+SEC("kprobe")
+int buffer_read_p1s(struct pt_regs *ctx) {
+	return do_buffer_read(PARSER_P1S);
+}
+
+SEC("kprobe")
+int buffer_read_p1b(struct pt_regs *ctx) {
+	return do_buffer_read(PARSER_P1B);
+}
+
+SEC("kprobe")
+int buffer_read_p2(struct pt_regs *ctx) {
+	return do_buffer_read(PARSER_P2);
+}
+
+SEC("kprobe")
+int buffer_read_p2a(struct pt_regs *ctx) {
+	return do_buffer_read(PARSER_P2A);
+}
+
+SEC("kprobe")
+int buffer_read_p2b(struct pt_regs *ctx) {
+	return do_buffer_read(PARSER_P2B);
+}
+
 // Some characters have been read into the buffer, so start parsing
 SEC("kretprobe/vfs_read")
 int BPF_KRETPROBE(vfs_read_ret, long ret)
 {
-	u32 pid = (u32) bpf_get_current_pid_tgid();
+	if (!active_files) {
+		return 0;
+	}
 
-    char task[TASK_COMM_LEN];	
-	bpf_get_current_comm(&task, sizeof(task));
-	if (!bpf_map_lookup_elem(&executables, &task)) {
-		// skip this executable
-		// Tracing to try to debug missing kretprobe calls
-		// if (pid > 4400) {
-		// 	bpf_printk("vfs_read ret: %d", pid);
-		// }		
+	struct pending_read_t *pr = bpf_task_storage_get(&reads, bpf_get_current_task_btf(), 0, 0);
+	if (!pr || !pr->slot) {
+		// Not a file read we are interested in
+		add_count(COUNT_READ_SKIP, 1);
 		return 0;
 	}
 
-	struct event *e = bpf_map_lookup_elem(&start_event, &pid);
-	if (!e) {
+	debug_printk("vfs_read ret: file read complete %d chars into into %x", ret, pr->buf);
+	if (ret <= 0){
+		pr->slot = 0;
+		return 0;
+	}
+
+	pr->length = ret; // number of chars to parse
+
+	bpf_tail_call(ctx, &tailcalls, DO_BUFFER_READ);
+	// Only get here if the tail call didn't happen
+	add_count(COUNT_TAIL_CALL_FAILS, 1);
+	pr->slot = 0;
+    return 0;
+}
+
+// With trampolines, one program sees the file, the buffer, the count and the
+// result of the read all together, so there's no need for the entry probe to
+// record where the buffer is. It only has to say that a read is in progress,
+// for fexit_filemap_read
+SEC("fentry/vfs_read")
+int BPF_PROG(fentry_read, struct file *file)
+{
+	if (!active_files || !current_stream(file)) {
+		return 0;
+	}
+
+	struct pending_read_t *pr = bpf_task_storage_get(&reads, bpf_get_current_task_btf(), 0, BPF_LOCAL_STORAGE_GET_F_CREATE);
+	if (pr) {
+		pr->in_read = file;
+	}
+	return 0;
+}
+
+SEC("fexit/vfs_read")
+int BPF_PROG(fexit_read, struct file *file, char *buf, size_t count, loff_t *pos, ssize_t ret)
+{
+	if (!active_files) {
+		return 0;
+	}
+
+	struct stream_t *st = current_stream(file);
+	if (!st) {
 		// Not a file read we are interested in
-		bpf_printk("vfs_read ret: Not interested for %d", pid);
+		add_count(COUNT_READ_SKIP, 1);
 		return 0;
 	}
 
-	struct buffer_t *b = bpf_map_lookup_elem(&buffer, &pid); 
-	if (!b) {
-		bpf_printk("vfs_read ret: No matching pid entry for %d", pid);
+	struct pending_read_t *pr = bpf_task_storage_get(&reads, bpf_get_current_task_btf(), 0, 0);
+	if (pr) {
+		pr->in_read = NULL;
+	}
+	if (ret <= 0) {
 		return 0;
 	}
 
-	bpf_printk("vfs_read ret: file read complete %d chars into into %x, total %d for pid %d", ret, b->buf, b->astate.total, pid);
-	if (ret <= 0){
+	// *pos has already been moved on past what was read
+	u64 offset = st->next_offset;
+	if (pos) {
+		bpf_probe_read_kernel(&offset, sizeof(offset), pos);
+		offset -= ret;
+	}
+	handle_read(st, buf, ret, offset, parser);
+	return 0;
+}
+
+// Most filesystems read through the page cache with filemap_read(), which is
+// underneath read(), but also readv(), preadv() and io_uring and AIO reads, none
+// of which call vfs_read(). Reads that came through vfs_read() are left to
+// fexit_read. The rest go through handle_read() like any other: a readv() or
+// io_uring read that starts where the last one ended is parsed in order, and
+// io_uring reads that finish out of order, as they can with several in flight
+// at once, are summarised
+#define MAX_SEGS 8
+
+struct seg_t {
+	char *buf;
+	u64 length;
+};
+
+SEC("fexit/filemap_read")
+int BPF_PROG(fexit_filemap_read, struct kiocb *iocb, struct iov_iter *iter, ssize_t already_read, ssize_t ret)
+{
+	if (!active_files || ret <= already_read) {
 		return 0;
 	}
 
-	b->depth = 0;    // keeping track of the number of tail calls, because you can only recurse to a depth of 32
-	b->length = ret; // number of chars to parse
+	struct file *file = iocb->ki_filp;
+	struct stream_t *st = current_stream(file);
+	if (!st) {
+		return 0;
+	}
 
-	bpf_map_update_elem(&buffer, &pid, b, 0);
-	bpf_tail_call(ctx, &tailcalls, DO_BUFFER_READ);
-    return 0;
+	struct pending_read_t *pr = bpf_task_storage_get(&reads, bpf_get_current_task_btf(), 0, 0);
+	if (pr && pr->in_read == file) {
+		return 0;
+	}
+
+	// The iterator and ki_pos have both been moved on past what was read, so
+	// the data ends just before where they are now
+	u64 length = ret - already_read;
+	u64 offset = iocb->ki_pos - length;
+	u64 off = iter->iov_offset;
+	u8 type = iter->iter_type;
+
+	// A single buffer, as from io_uring's IORING_OP_READ (ITER_UBUF is new in
+	// 6.0, before which these were one segment iovecs)
+	if (bpf_core_enum_value_exists(enum iter_type, ITER_UBUF) &&
+	    type == bpf_core_enum_value(enum iter_type, ITER_UBUF)) {
+		handle_read(st, (char *)iter->ubuf + off - length, length, offset, parser);
+		return 0;
+	}
+
+	if (type != bpf_core_enum_value(enum iter_type, ITER_IOVEC) || !bpf_core_field_exists(iter->__iov)) {
+		// Kernel buffers, which aren't a reader we're watching
+		__sync_fetch_and_add(&st->bypassed, 1);
+		return 0;
+	}
+
+	// readv() may have filled several segments. Walk backwards from the
+	// current one to find them, then parse them in file order
+	u64 iov = (u64)iter->__iov;
+	struct seg_t segs[MAX_SEGS] = {};
+	u64 remaining = length;
+	u32 n = 0;
+	for (u32 i = 0; i < MAX_SEGS && remaining; i++) {
+		struct iovec v = {};
+		if (off == 0) {
+			iov -= sizeof(v);
+			bpf_probe_read_kernel(&v, sizeof(v), (void *)iov);
+			off = v.iov_len;
+			continue;
+		}
+		bpf_probe_read_kernel(&v, sizeof(v), (void *)iov);
+		u64 take = off < remaining ? off : remaining;
+		segs[n].buf = (char *)v.iov_base + off - take;
+		segs[n].length = take;
+		n++;
+		remaining -= take;
+		off -= take;
+	}
+	if (remaining) {
+		debug_printk("filemap_read: too many segments for %s", st->filename);
+		__sync_fetch_and_add(&st->bypassed, 1);
+		return 0;
+	}
+
+	for (u32 i = 0; i < MAX_SEGS; i++) {
+		if (i >= n) {
+			break;
+		}
+		struct seg_t *seg = &segs[n - 1 - i];
+		handle_read(st, seg->buf, seg->length, offset, parser);
+		offset += seg->length;
+	}
+	return 0;
+}
+
+// The data for these never passes through a user buffer we could look at, so
+// all we can do is say that the result is missing something
+static __always_inline int bypass(struct file *file, const char *how)
+{
+	if (!active_files || !file) {
+		return 0;
+	}
+
+	struct stream_t *st = current_stream(file);
+	if (st) {
+		debug_printk("%s: %s bypasses vfs_read", how, st->filename);
+		__sync_fetch_and_add(&st->bypassed, 1);
+	}
+	return 0;
+}
+
+// splice() and sendfile() from a file
+SEC("fentry/vfs_splice_read")
+int BPF_PROG(fentry_splice_read, struct file *in)
+{
+	return bypass(in, "splice");
+}
+
+// copy_file_range(), which may not even copy the data if the filesystem can
+// share extents
+SEC("fentry/vfs_copy_file_range")
+int BPF_PROG(fentry_copy_file_range, struct file *file_in)
+{
+	return bypass(file_in, "copy_file_range");
+}
+
+// mmap() of the file. The pages are read by page faults, or not at all
+SEC("fentry/security_mmap_file")
+int BPF_PROG(fentry_mmap, struct file *file)
+{
+	return bypass(file, "mmap");
+}
+
+// Parsing state for replay. Replay runs one file at a time from a single
+// thread, so one copy is enough. It's static to keep it out of the skeleton
+static struct line_state replay_state;
+
+// Parse a chunk of a file that user space hands us with BPF_PROG_TEST_RUN
+// (see day1 --replay). This goes through exactly the same parse_buffer() as the
+// probes do, but without needing a reader, and without any other VFS traffic
+// getting in the way of timing it
+SEC("syscall")
+int replay(struct replay_args *args)
+{
+	if (args->reset) {
+		init_state(&replay_state);
+	}
+
+	u64 start = bpf_ktime_get_ns();
+	parse_buffer((char *)args->buf, args->length, &replay_state, parser);
+	args->run_ns = bpf_ktime_get_ns() - start;
+
+	args->total = replay_state.total;
+	args->lines = replay_state.lines;
+	return 0;
 }
 
 char LICENSE[] SEC("license") = "Dual BSD/GPL";
@@ -4,19 +4,128 @@
 #include <string.h>
 #include <signal.h>
 #include <time.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <limits.h>
+#include <glob.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <bpf/libbpf.h>
+#include <bpf/bpf.h>
 #include "day1.h"
 #include "day1.skel.h"
 
-#define PERF_BUFFER_PAGES	16
-#define PERF_POLL_TIMEOUT_MS	100
-
 static bool keepRunning = true;
+static volatile bool showHists;
+
+// Most --file and --exec options
+#define MAX_ARGS 64
+
+// Maps marked for pinning (results), and everything in daemon mode, go in here
+#define PIN_ROOT "/sys/fs/bpf/day1"
+
+static struct {
+	bool latency;
+	bool prog_stats;
+	bool stats;
+	enum advent_parser parser;
+	const char *replay_file;
+	long chunk_size;
+	long repeat;
+	long long expect;
+	long interval_ms;
+	bool parser_set;
+	bool daemon;
+	bool unpin;
+	bool kprobes;
+	bool load_stats;
+	bool hists;
+	bool debug;
+	const char *words_file;
+	const char *files[MAX_ARGS];
+	int nfiles;
+	const char *execs[MAX_ARGS];
+	int nexecs;
+} env = {
+	.parser = PARSER_P2,
+	.chunk_size = 128 * 1024,
+	.repeat = 1,
+	.expect = -1,
+};
+
+static const char *parser_names[] = {
+	[PARSER_P1] = "p1",
+	[PARSER_P1S] = "p1s",
+	[PARSER_P1B] = "p1b",
+	[PARSER_P2] = "p2",
+	[PARSER_P2A] = "p2a",
+	[PARSER_P2B] = "p2b",
+};
+
+static const struct option long_options[] = {
+	{ "parser", required_argument, NULL, 'p' },
+	{ "latency", no_argument, NULL, 'l' },
+	{ "prog-stats", no_argument, NULL, 's' },
+	{ "stats", no_argument, NULL, 'S' },
+	{ "replay", required_argument, NULL, 'r' },
+	{ "chunk-size", required_argument, NULL, 'c' },
+	{ "repeat", required_argument, NULL, 'n' },
+	{ "expect", required_argument, NULL, 'e' },
+	{ "interval", required_argument, NULL, 'i' },
+	{ "daemon", no_argument, NULL, 'd' },
+	{ "unpin", no_argument, NULL, 'U' },
+	{ "kprobes", no_argument, NULL, 'k' },
+	{ "load-stats", no_argument, NULL, 'L' },
+	{ "histograms", no_argument, NULL, 'H' },
+	{ "words", required_argument, NULL, 'w' },
+	{ "file", required_argument, NULL, 'f' },
+	{ "exec", required_argument, NULL, 'x' },
+	{ "debug", no_argument, NULL, 'D' },
+	{ "help", no_argument, NULL, 'h' },
+	{},
+};
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [options]\n"
+	       "  -p, --parser NAME  p1, p1s, p1b, p2 (the default), p2a or p2b\n"
+	       "  -l, --latency      show the time from the file being closed to the result arriving\n"
+	       "  -s, --prog-stats   enable BPF run time stats and print them per program on exit\n"
+	       "  -S, --stats        count what the probes do and print rates every second, and the\n"
+	       "                     memory the maps are using on exit\n"
+	       "  -r, --replay FILE  parse FILE with BPF_PROG_TEST_RUN instead of attaching probes\n"
+	       "  -c, --chunk-size N bytes passed to the parser per run when replaying (default 131072)\n"
+	       "  -n, --repeat N     replay the file N times (default 1)\n"
+	       "  -e, --expect N     check the replayed result is N\n"
+	       "  -i, --interval MS  read results from the pinned results map every MS milliseconds\n"
+	       "                     instead of getting an event for each one\n"
+	       "  -d, --daemon       leave the probes attached and pinned when day1 exits, and pick\n"
+	       "                     them up again next time (switching parser if -p is given)\n"
+	       "  -U, --unpin        detach pinned probes and remove everything under " PIN_ROOT "\n"
+	       "  -k, --kprobes      use kprobes even if fentry/fexit are available\n"
+	       "  -L, --load-stats   load the programs without attaching them, and print what they\n"
+	       "                     and the maps cost\n"
+	       "  -H, --histograms   print histograms of parse time and size per read, open to close\n"
+	       "                     time and parse time per byte on exit, or on SIGUSR1\n"
+	       "  -w, --words FILE   digit words for p2a and p2b, one \"word digit\" per line\n"
+	       "                     (default one 1 ... nine 9)\n"
+	       "  -f, --file PATH    watch a file, the files under a directory, or the files matching\n"
+	       "                     a glob. Can be repeated (default advent*)\n"
+	       "  -x, --exec COMM    only watch files opened by COMM, or by anything if COMM is *.\n"
+	       "                     Can be repeated (default cat and reader)\n"
+	       "  -D, --debug        write trace messages from the BPF programs to trace_pipe\n",
+	       prog);
+}
 
 void intHandler(int) {
     keepRunning = false;
 }
 
+void usr1Handler(int) {
+    showHists = true;
+}
+
 static int libbpf_print_fn(enum libbpf_print_level level, const char *format, va_list args)
 {
 	if (level >= LIBBPF_DEBUG)
@@ -25,30 +134,210 @@ static int libbpf_print_fn(enum libbpf_print_level level, const char *format, va
 	return vfprintf(stderr, format, args);
 }
 
-void handle_event(void *ctx, int cpu, void *data, __u32 data_sz)
+int handle_event(void *ctx, void *data, size_t data_sz)
 {
-	struct event e;
+	const struct event *e = data;
 	struct tm *tm;
 	char ts[32];
 	time_t t;
 
-	if (data_sz < sizeof(e)) {
+	if (data_sz < sizeof(*e)) {
 		printf("Error: packet too small\n");
-		return;
+		return 0;
 	}
-	/* Copy data as alignment in the perf buffer isn't guaranteed. */
-	memcpy(&e, data, sizeof(e));
 
 	time(&t);
 	tm = localtime(&t);
 	strftime(ts, sizeof(ts), "%H:%M:%S", tm);
-	printf("%-8s %-6d %-8s %-16s %-6d\n",
-	       ts, e.pid, e.task, e.filename, e.result);
+	printf("%-8s %-6d %-8s %-16s %-6llu",
+	       ts, e->pid, e->task, e->filename, (unsigned long long)e->result);
+	if (env.latency) {
+		// bpf_ktime_get_ns() uses the same clock as CLOCK_MONOTONIC
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		__u64 now_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+		printf(" %10.1f", (now_ns - e->close_ns) / 1000.0);
+	}
+	if (e->unmerged) {
+		printf(" (incomplete: %u reads couldn't be joined up)", e->unmerged);
+	}
+	if (e->bypassed) {
+		printf(" (incomplete: read %u times without read() or readv())", e->bypassed);
+	}
+	printf("\n");
+	return 0;
 }
 
-void lost_event(void *ctx, int cpu, long long unsigned int data_sz)
+// Number of results to take from the map with each batch call
+#define RESULT_BATCH 256
+
+// Print a batch of results from the results map. The time is only worked out
+// once for the whole batch
+static void print_results(const struct result_t *r, __u32 n)
 {
-	printf("lost event\n");
+	struct timespec now;
+	struct tm *tm;
+	char ts[32];
+	time_t t;
+
+	time(&t);
+	tm = localtime(&t);
+	strftime(ts, sizeof(ts), "%H:%M:%S", tm);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	__u64 now_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+	for (__u32 i = 0; i < n; i++) {
+		printf("%-8s %-6d %-8s %-16s %-6llu",
+		       ts, r[i].pid, r[i].task, r[i].filename, (unsigned long long)r[i].result);
+		if (env.latency) {
+			printf(" %10.1f", (now_ns - r[i].close_ns) / 1000.0);
+		}
+		printf(" %8llu %10llu %6u", (unsigned long long)r[i].lines,
+		       (unsigned long long)r[i].bytes, r[i].closes);
+		if (r[i].unmerged) {
+			printf(" (incomplete: %u reads couldn't be joined up)", r[i].unmerged);
+		}
+		if (r[i].bypassed) {
+			printf(" (incomplete: read %u times without read() or readv())", r[i].bypassed);
+		}
+		printf("\n");
+	}
+}
+
+// Take everything out of the results map a batch at a time and print it
+static int drain_results(struct day1_bpf *skel)
+{
+	static struct inode_key keys[RESULT_BATCH];
+	static struct result_t values[RESULT_BATCH];
+	// The batch position is opaque, but has to be at least as big as a key
+	struct inode_key batch;
+	void *in = NULL;
+	int fd = bpf_map__fd(skel->maps.results);
+	int err;
+
+	do {
+		__u32 count = RESULT_BATCH;
+		err = bpf_map_lookup_and_delete_batch(fd, in, &batch, keys, values, &count, NULL);
+		if (err && err != -ENOENT) {
+			fprintf(stderr, "Failed to read results: %d\n", err);
+			return err;
+		}
+		print_results(values, count);
+		in = &batch;
+	} while (!err);
+
+	fflush(stdout);
+	return 0;
+}
+
+// With --load-stats each program gets its own log, at BPF_LOG_STATS level,
+// which is just the few lines of totals at the end. The programs are in
+// skeleton order. If the load fails, it's done again with prog_log_level 0,
+// which makes libbpf retry the program that failed at level 1, and the end of
+// that log says why
+#define MAX_PROGS 64
+#define PROG_LOG_SIZE 4096
+static char prog_logs[MAX_PROGS][PROG_LOG_SIZE];
+static __u32 prog_log_level = 4;
+static double load_ns;
+
+// Find "name N" in a verifier log and return N, or -1
+static long log_value(const char *log, const char *name)
+{
+	const char *p = strstr(log, name);
+	long v;
+	if (!p || sscanf(p + strlen(name), " %ld", &v) != 1) {
+		return -1;
+	}
+	return v;
+}
+
+// Print the memory each map has charged to memlock, from the memlock line of its
+// fdinfo. For maps that allocate on demand it goes up as entries are added
+static void print_map_memory(struct day1_bpf *skel)
+{
+	unsigned long long total = 0;
+	printf("%-16s %-14s %8s %6s %8s %10s\n", "MAP", "TYPE", "ENTRIES", "KEY", "VALUE", "MEMLOCK");
+	for (int i = 0; i < skel->skeleton->map_cnt; i++) {
+		struct bpf_map *map = *skel->skeleton->maps[i].map;
+		int fd = bpf_map__fd(map);
+		if (fd < 0) {
+			continue;
+		}
+
+		char path[64], line[128];
+		unsigned long long memlock = 0;
+		snprintf(path, sizeof(path), "/proc/self/fdinfo/%d", fd);
+		FILE *f = fopen(path, "r");
+		if (f) {
+			while (fgets(line, sizeof(line), f)) {
+				if (sscanf(line, "memlock: %llu", &memlock) == 1) {
+					break;
+				}
+			}
+			fclose(f);
+		}
+		total += memlock;
+
+		const char *type = libbpf_bpf_map_type_str(bpf_map__type(map));
+		printf("%-16s %-14s %8u %6u %8u %10llu\n", bpf_map__name(map),
+		       type ? type : "?", bpf_map__max_entries(map), bpf_map__key_size(map),
+		       bpf_map__value_size(map), memlock);
+	}
+	printf("%-16s %-14s %8s %6s %8s %10llu\n", "total", "", "", "", "", total);
+}
+
+// Print what it cost to load each program: instructions the verifier went
+// through, states, stack depth (for the program and each of its callbacks),
+// size after rewriting and after JITing, and time spent verifying. The stats
+// come from the end of the verifier log and from bpf_prog_info
+static void print_load_stats(struct day1_bpf *skel)
+{
+	printf("LOAD_MS %.1f\n", load_ns / 1e6);
+	printf("%-24s %10s %8s %8s %-12s %8s %8s %10s\n", "PROG", "INSNS", "PEAK", "STATES",
+	       "STACK", "XLATED", "JITED", "VERIFY_US");
+	for (int i = 0; i < skel->skeleton->prog_cnt && i < MAX_PROGS; i++) {
+		struct bpf_program *prog = *skel->skeleton->progs[i].prog;
+		struct bpf_prog_info info = {};
+		__u32 len = sizeof(info);
+		int fd = bpf_program__fd(prog);
+
+		if (fd < 0 || bpf_prog_get_info_by_fd(fd, &info, &len)) {
+			continue;
+		}
+
+		const char *log = prog_logs[i];
+		char stack[32] = "-";
+		const char *p = strstr(log, "stack depth ");
+		if (p) {
+			sscanf(p, "stack depth %31s", stack);
+		}
+		printf("%-24s %10u %8ld %8ld %-12s %8u %8u %10ld\n", bpf_program__name(prog),
+		       info.verified_insns, log_value(log, "peak_states"), log_value(log, "total_states"),
+		       stack, info.xlated_prog_len, info.jited_prog_len, log_value(log, "verification time"));
+	}
+	printf("\n");
+	print_map_memory(skel);
+}
+
+// Print how many times each loaded program ran and how long it took in total
+static void print_prog_stats(struct day1_bpf *skel)
+{
+	struct bpf_program *prog;
+
+	printf("%-16s %12s %16s %12s\n", "PROG", "RUNS", "RUN_TIME_NS", "NS/RUN");
+	bpf_object__for_each_program(prog, skel->obj) {
+		struct bpf_prog_info info = {};
+		__u32 len = sizeof(info);
+		int fd = bpf_program__fd(prog);
+
+		if (fd < 0 || bpf_prog_get_info_by_fd(fd, &info, &len)) {
+			continue;
+		}
+		printf("%-16s %12llu %16llu %12.1f\n", bpf_program__name(prog),
+		       (unsigned long long)info.run_cnt, (unsigned long long)info.run_time_ns,
+		       info.run_cnt ? (double)info.run_time_ns / info.run_cnt : 0.0);
+	}
 }
 
 void filter_executable(struct day1_bpf *skel, const char *exe) {
@@ -60,146 +349,526 @@ void filter_executable(struct day1_bpf *skel, const char *exe) {
 	printf("filtered %s\n", exe);
 }
 
-void filter_filename(struct day1_bpf *skel, const char *filename) {
-	struct filename_t f; 
-	memset(&f, 0, sizeof(f));
-	__u32 val = 1;
-	strncpy((char *)&f.name, filename, strlen(filename));
-	bpf_map__update_elem(skel->maps.filenames, &f, sizeof(f), &val, sizeof(val), 0);
-	printf("filtered %s\n", filename);
-}
-
-#ifdef PART2A
-#define ADD_ENTRY(ss, ii, nn, oo) si.state=ss;si.input=ii;so.new_state=nn;so.output=oo; \
-	bpf_map__update_elem(skel->maps.state_table, &si, sizeof(si), &so, sizeof(so), 0);
-
-
-//          e  i  g  h  t  o  n  r  w  f  u  v  s  x
-// 0        1           7  5  22       12       17
-// 1 e      1  2
-// 2 ei           3
-// 3 eig             4
-// 4 eigh               *8 
-//                       /7 
-// 5 o                     5  6
-// 6 on     *1 23
-//           /1
-// 7 t               8  7            11
-// 8 th                          9
-// 9 thr    10
-//10 thre   *3 2 
-//           /1
-//11 tw                    *2
-//                          /5 
-//12 f         15          13          12
-//13 fo                        6           14
-//14 fou                         *4
-//15 fi                                      15  
-//16 fiv    *5
-//           /1
-//17 s      19 18                                 17
-//18 si                                             *6
-//19 se        2                             20
-//20 sev    21
-//21 seve      2              *7
-//                             /22
-//22 n         23             22
-//23 ni                       24
-//24 nin    *9 23
-//           /1                 
-
-// Additionally if the new state is 0, we need to run through the table again to
-// account for the input being the first character of a number
-void populate_state_table(struct day1_bpf *skel) {
-	struct state_input si = {};
-	struct state_output so = {}; 
-
-	ADD_ENTRY(0, 'e', 1, 0);
-	ADD_ENTRY(0, 't', 7, 0);
-	ADD_ENTRY(0, 'o', 5, 0);
-	ADD_ENTRY(0, 'n', 22, 0);
-	ADD_ENTRY(0, 'f', 12, 0);
-	ADD_ENTRY(0, 's', 17, 0);
-
-	ADD_ENTRY(1, 'e', 1, 0);
-	ADD_ENTRY(1, 'i', 2, 0);
-	ADD_ENTRY(2, 'g', 3, 0);
-	ADD_ENTRY(3, 'h', 4, 0);
-	ADD_ENTRY(4, 't', 7, 8);
-
-	ADD_ENTRY(5, 'o', 5, 0);
-	ADD_ENTRY(5, 'n', 6, 0);
-	ADD_ENTRY(6, 'e', 1, 1);
-	ADD_ENTRY(6, 'i', 23, 0);
-
-	ADD_ENTRY(7, '7', 7, 0);
-	ADD_ENTRY(7, 'h', 8, 0);
-	ADD_ENTRY(7, 'w', 11, 0);
-	ADD_ENTRY(8, 'r', 9, 0);
-	ADD_ENTRY(9, 'e', 10, 0);
-	ADD_ENTRY(10, 'e', 1, 3);
-	ADD_ENTRY(10, 'i', 2, 0);
-	ADD_ENTRY(11, 'o', 5, 2);
-
-	ADD_ENTRY(12, 'i', 15, 0);
-	ADD_ENTRY(12, 'o', 13, 0);
-	ADD_ENTRY(12, 'f', 12, 0);
-
-	ADD_ENTRY(13, 'n', 6, 0);
-	ADD_ENTRY(13, 'u', 14, 0);
-	ADD_ENTRY(14, 'r', 0, 4);
-	ADD_ENTRY(15, 'v', 16, 0);
-	ADD_ENTRY(16, 'e', 1, 5);
-
-	ADD_ENTRY(17, 'e', 19, 0);
-	ADD_ENTRY(17, 'i', 18, 0);
-	ADD_ENTRY(17, 's', 17, 0);
-
-	ADD_ENTRY(18, 'x', 0, 6);
-	ADD_ENTRY(19, 'i', 2, 0);
-	ADD_ENTRY(19, 'v', 20, 0);
-	ADD_ENTRY(20, 'e', 21, 0);
-	ADD_ENTRY(21, 'n', 22, 7);
-	ADD_ENTRY(21, 'i', 2, 0);
-
-	ADD_ENTRY(22, 'i', 23, 0);
-	ADD_ENTRY(22, 'n', 22, 0);
-	ADD_ENTRY(23, 'n', 24, 0);
-	ADD_ENTRY(24, 'e', 1, 9);
-	ADD_ENTRY(24, 'i', 23, 0);
-}
-#endif
-
-int main()
+// Files and directories to watch, worked out from --file before loading
+#define MAX_TARGETS 1024
+static struct {
+	struct inode_key key;
+	__u32 kind;
+	char path[PATH_MAX];
+} targets[MAX_TARGETS];
+static int ntargets;
+
+static int add_target(const char *path)
 {
-    struct day1_bpf *skel;
-	struct perf_buffer *pb = NULL;
+	struct stat st;
 
-    int err = 0;
+	if (stat(path, &st)) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+	if (ntargets >= MAX_TARGETS) {
+		fprintf(stderr, "Too many files to watch\n");
+		return -E2BIG;
+	}
 
-	struct sigaction act;
-    act.sa_handler = intHandler;
-    sigaction(SIGINT, &act, NULL);
+	// The kernel keeps device numbers as major << 20 | minor
+	targets[ntargets].key.ino = st.st_ino;
+	targets[ntargets].key.dev = (major(st.st_dev) << 20) | minor(st.st_dev);
+	targets[ntargets].kind = S_ISDIR(st.st_mode) ? TARGET_DIR : TARGET_FILE;
+	snprintf(targets[ntargets].path, sizeof(targets[ntargets].path), "%s", path);
+	ntargets++;
+	return 0;
+}
 
-	libbpf_set_strict_mode(LIBBPF_STRICT_ALL);
-	libbpf_set_print(libbpf_print_fn);
+// Turn the --file paths into inodes. Globs are expanded now, so files created
+// later that would match them aren't watched (unless they're in a watched
+// directory)
+static int resolve_targets(void)
+{
+	for (int i = 0; i < env.nfiles; i++) {
+		const char *path = env.files[i];
+		if (!strpbrk(path, "*?[")) {
+			if (add_target(path)) {
+				return 1;
+			}
+			continue;
+		}
+
+		glob_t g;
+		if (glob(path, 0, NULL, &g)) {
+			fprintf(stderr, "%s: no matches\n", path);
+			continue;
+		}
+		for (size_t j = 0; j < g.gl_pathc; j++) {
+			if (add_target(g.gl_pathv[j])) {
+				globfree(&g);
+				return 1;
+			}
+		}
+		globfree(&g);
+	}
+
+	if (!ntargets) {
+		fprintf(stderr, "No files to watch\n");
+		return 1;
+	}
+	return 0;
+}
+
+static bool watch_dirs(void)
+{
+	for (int i = 0; i < ntargets; i++) {
+		if (targets[i].kind == TARGET_DIR) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Whether --exec * was given, so any executable will do
+static bool any_exec(void)
+{
+	for (int i = 0; i < env.nexecs; i++) {
+		if (!strcmp(env.execs[i], "*")) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void filter_targets(struct day1_bpf *skel) {
+	for (int i = 0; i < ntargets; i++) {
+		bpf_map__update_elem(skel->maps.targets, &targets[i].key, sizeof(targets[i].key),
+				     &targets[i].kind, sizeof(targets[i].kind), 0);
+		printf("watching %s%s\n", targets[i].path, targets[i].kind == TARGET_DIR ? "/" : "");
+	}
+}
+
+// The state machine for p2a and p2b is generated from a list of words, each
+// with the digit it stands for. It's an Aho-Corasick automaton: a trie of the
+// words, where each node also knows the longest suffix of what it's matched so
+// far that is the start of another word (its fail link). Following the fail
+// links to fill in every missing transition turns it into a DFA that finds
+// every word, including ones that overlap like "eightwo", in one pass with one
+// step per character.
+//
+// The output is on the transitions: going into the node for the end of a word
+// outputs that word's digit. A node with no children behaves exactly like its
+// fail link from then on, so it doesn't need a state of its own, and
+// transitions into it go to (what stands in for) its fail link instead. For
+// one..nine that leaves 25 states, the same as the hand-drawn table this
+// replaced.
+#define MAX_WORDS 64
+#define MAX_NODES (MAX_WORDS * MAX_WORD_LEN + 1)
+
+struct fsm_word {
+	char word[MAX_WORD_LEN + 1];
+	char value;
+};
+
+static const struct fsm_word default_words[] = {
+	{ "one", 1 }, { "two", 2 }, { "three", 3 }, { "four", 4 }, { "five", 5 },
+	{ "six", 6 }, { "seven", 7 }, { "eight", 8 }, { "nine", 9 },
+};
+
+// Trie nodes. Node 0 is the root
+static struct {
+	int next[FSM_INPUTS];
+	// Whether next[c] is an edge in the trie rather than a filled in one
+	bool child[FSM_INPUTS];
+	int fail;
+	bool leaf;
+	// Value and length of the longest word that ends here
+	char output;
+	char length;
+	// Which state this node is, or stands in for
+	int state;
+} nodes[MAX_NODES];
+
+static struct state_output dense_fsm[FSM_STATES * FSM_INPUTS];
+static struct state_input fsm_keys[FSM_STATES * FSM_INPUTS];
+static struct state_output fsm_values[FSM_STATES * FSM_INPUTS];
+static __u32 fsm_entries;
+
+// Read "word digit" lines
+static int read_words(const char *path, struct fsm_word *words, int *count)
+{
+	FILE *f = fopen(path, "r");
+	char line[256];
+	char word[256];
+	int value;
+
+	if (!f) {
+		perror(path);
+		return -errno;
+	}
+	*count = 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || sscanf(line, "%255s %d", word, &value) != 2) {
+			continue;
+		}
+		if (strlen(word) > MAX_WORD_LEN || value < 1 || value > 9 || *count >= MAX_WORDS) {
+			fprintf(stderr, "%s: can't use \"%s %d\": at most %d words of up to %d characters, with values 1-9\n",
+				path, word, value, MAX_WORDS, MAX_WORD_LEN);
+			fclose(f);
+			return -EINVAL;
+		}
+		strcpy(words[*count].word, word);
+		words[*count].value = value;
+		(*count)++;
+	}
+	fclose(f);
+	return 0;
+}
+
+// Build the dense table for p2b and the sparse entries for p2a's hash table
+static int build_fsm(const struct fsm_word *words, int count)
+{
+	int queue[MAX_NODES];
+	int nnodes = 1;
+	int head = 0, tail = 0;
+
+	memset(nodes, 0, sizeof(nodes));
+	nodes[0].leaf = true;
+	for (int w = 0; w < count; w++) {
+		int n = 0;
+		int len = strlen(words[w].word);
+		for (int i = 0; i < len; i++) {
+			unsigned char c = words[w].word[i];
+			if (!nodes[n].child[c]) {
+				nodes[n].child[c] = true;
+				nodes[n].next[c] = nnodes;
+				nodes[n].leaf = false;
+				nodes[nnodes].leaf = true;
+				nnodes++;
+			}
+			n = nodes[n].next[c];
+		}
+		nodes[n].output = words[w].value;
+		nodes[n].length = len;
+	}
+
+	// Breadth first, so a node's fail link is always done before it is
+	for (int c = 0; c < FSM_INPUTS; c++) {
+		if (nodes[0].child[c]) {
+			queue[tail++] = nodes[0].next[c];
+		}
+	}
+	while (head < tail) {
+		int u = queue[head++];
+		int f = nodes[u].fail;
+		if (!nodes[u].output) {
+			// A shorter word may end here, e.g. "two" at the end of "eightwo"
+			nodes[u].output = nodes[f].output;
+			nodes[u].length = nodes[f].length;
+		}
+		for (int c = 0; c < FSM_INPUTS; c++) {
+			if (nodes[u].child[c]) {
+				nodes[nodes[u].next[c]].fail = nodes[f].next[c];
+				queue[tail++] = nodes[u].next[c];
+			} else {
+				nodes[u].next[c] = nodes[f].next[c];
+			}
+		}
+	}
+
+	// Number the nodes that need a state, in breadth first order so the root
+	// is state 0. Leaves take the state of their fail link, which is
+	// shallower so has already been numbered
+	int states = 1;
+	nodes[0].state = 0;
+	for (int i = 0; i < tail; i++) {
+		int u = queue[i];
+		nodes[u].state = nodes[u].leaf ? nodes[nodes[u].fail].state : states++;
+	}
+	if (states > FSM_STATES) {
+		fprintf(stderr, "The word list needs %d states, but there's only room for %d\n", states, FSM_STATES);
+		return -E2BIG;
+	}
+
+	// Fill in every transition for every state
+	memset(dense_fsm, 0, sizeof(dense_fsm));
+	for (int u = 0; u < nnodes; u++) {
+		if (u && nodes[u].leaf) {
+			continue;
+		}
+		for (int c = 0; c < FSM_INPUTS; c++) {
+			int v = nodes[u].next[c];
+			struct state_output *so = &dense_fsm[nodes[u].state * FSM_INPUTS + c];
+			so->new_state = nodes[v].state;
+			so->output = nodes[v].output;
+			so->length = nodes[v].length;
+		}
+	}
+
+	// p2a looks up (state, input), and if there's no entry it uses the entry
+	// for (0, input) without its output. So only the transitions that differ
+	// from that need an entry
+	fsm_entries = 0;
+	for (int s = 0; s < states; s++) {
+		for (int c = 0; c < FSM_INPUTS; c++) {
+			struct state_output *so = &dense_fsm[s * FSM_INPUTS + c];
+			struct state_output *root = &dense_fsm[c];
+			bool needed = s == 0 ? so->new_state || so->output :
+				so->output || so->new_state != root->new_state;
+			if (!needed) {
+				continue;
+			}
+			fsm_keys[fsm_entries].state = s;
+			fsm_keys[fsm_entries].input = c;
+			fsm_values[fsm_entries] = *so;
+			fsm_entries++;
+		}
+	}
+
+	printf("state machine: %d words, %d states, %u transitions\n", count, states, fsm_entries);
+	return 0;
+}
+
+// Load all of p2a's transitions with one system call
+static int populate_state_table(struct day1_bpf *skel)
+{
+	__u32 count = fsm_entries;
+	int err = bpf_map_update_batch(bpf_map__fd(skel->maps.state_table), fsm_keys, fsm_values, &count, NULL);
+	if (err) {
+		fprintf(stderr, "Failed to load the state table: %d\n", err);
+	}
+	return err;
+}
+
+static void populate_dense_table(struct state_output *dense)
+{
+	memcpy(dense, dense_fsm, sizeof(dense_fsm));
+}
+
+// FNV-1a of the dense table, which is enough to tell one word list from another
+static __u32 fsm_hash(void)
+{
+	const unsigned char *p = (const unsigned char *)dense_fsm;
+	__u32 h = 2166136261u;
+
+	for (size_t i = 0; i < sizeof(dense_fsm); i++) {
+		h = (h ^ p[i]) * 16777619u;
+	}
+	return h;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static char log_buf[64 * 1024];
+
+enum load_mode {
+	LOAD_TRAMPOLINES,
+	LOAD_KPROBES,
+	LOAD_REPLAY,
+};
+
+static const char *mode_names[] = {
+	[LOAD_TRAMPOLINES] = "fentry/fexit",
+	[LOAD_KPROBES] = "kprobes",
+	[LOAD_REPLAY] = "replay",
+};
+
+// Choose between trampolines (fentry/fexit) and kprobes. Only one set of
+// programs gets loaded. Replay doesn't need any of them, just the replay
+// program itself
+// Whether the kernel has a function we can attach a trampoline to
+static bool kernel_has(const char *func)
+{
+	return libbpf_find_vmlinux_btf_id(func, BPF_TRACE_FENTRY) >= 0;
+}
+
+static void set_attach_mode(struct day1_bpf *skel, enum load_mode mode)
+{
+	struct bpf_program *prog;
+
+	if (mode == LOAD_REPLAY) {
+		bpf_object__for_each_program(prog, skel->obj) {
+			bpf_program__set_autoload(prog, false);
+		}
+		bpf_program__set_autoload(skel->progs.replay, true);
+		return;
+	}
+
+	bool trampolines = mode == LOAD_TRAMPOLINES;
+	bpf_program__set_autoload(skel->progs.replay, false);
+	bpf_program__set_autoload(skel->progs.fexit_open, trampolines);
+	bpf_program__set_autoload(skel->progs.fentry_close, trampolines);
+	bpf_program__set_autoload(skel->progs.fexit_read, trampolines);
+
+	// Ways of reading a file other than read(). These are only attached with
+	// trampolines, and only if this kernel has the function to attach to.
+	// fentry_read is only needed to keep filemap_read away from read()s
+	bool filemap = trampolines && kernel_has("filemap_read");
+	bpf_program__set_autoload(skel->progs.fentry_read, filemap);
+	bpf_program__set_autoload(skel->progs.fexit_filemap_read, filemap);
+	bpf_program__set_autoload(skel->progs.fentry_splice_read, trampolines && kernel_has("vfs_splice_read"));
+	bpf_program__set_autoload(skel->progs.fentry_copy_file_range, trampolines && kernel_has("vfs_copy_file_range"));
+	bpf_program__set_autoload(skel->progs.fentry_mmap, trampolines && kernel_has("security_mmap_file"));
+
+	bpf_program__set_autoload(skel->progs.vfs_open, !trampolines);
+	bpf_program__set_autoload(skel->progs.vfs_open_ret, !trampolines);
+	bpf_program__set_autoload(skel->progs.filp_close, !trampolines);
+	bpf_program__set_autoload(skel->progs.vfs_read, !trampolines);
+	bpf_program__set_autoload(skel->progs.vfs_read_ret, !trampolines);
+	// All the parsers are loaded so that set_parser() can switch between them
+	bpf_program__set_autoload(skel->progs.buffer_read_p1, !trampolines);
+	bpf_program__set_autoload(skel->progs.buffer_read_p1s, !trampolines);
+	bpf_program__set_autoload(skel->progs.buffer_read_p1b, !trampolines);
+	bpf_program__set_autoload(skel->progs.buffer_read_p2, !trampolines);
+	bpf_program__set_autoload(skel->progs.buffer_read_p2a, !trampolines);
+	bpf_program__set_autoload(skel->progs.buffer_read_p2b, !trampolines);
+}
+
+// Point the buffer_read tail call at the given parser. This only affects the
+// kprobes, and takes effect on the next read
+static int set_parser(struct day1_bpf *skel, enum advent_parser p)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "buffer_read_%s", parser_names[p]);
+	struct bpf_program *prog = bpf_object__find_program_by_name(skel->obj, name);
+	if (!prog) {
+		return -ENOENT;
+	}
+
+	__u32 key = DO_BUFFER_READ;
+	int fd = bpf_program__fd(prog);
+	return bpf_map__update_elem(skel->maps.tailcalls, &key, sizeof(key), &fd, sizeof(fd), 0);
+}
+
+// Pin every map, so that the next run of day1 --daemon, or another object
+// with a new parser in it, uses the same ones. libbpf reuses a map that's
+// already pinned rather than creating it. .rodata and .bss belong to the
+// programs that were loaded with them, so they're left alone
+static void pin_maps(struct day1_bpf *skel)
+{
+	struct bpf_map *map;
+	char path[PATH_MAX];
+
+	bpf_object__for_each_map(map, skel->obj) {
+		if (bpf_map__is_internal(map)) {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s", PIN_ROOT, bpf_map__name(map));
+		bpf_map__set_pin_path(map, path);
+	}
+}
+
+// Scratch buffers are only needed for the CPUs that are online, and each one is
+// ADVENT_BUFFER_LEN, so there's one for every CPU up to the highest online one
+// rather than one for every possible CPU. Falls back to the possible CPUs if
+// the online list can't be read
+static int scratch_entries(void)
+{
+	char buf[256];
+	int n = 0;
+
+	FILE *f = fopen("/sys/devices/system/cpu/online", "r");
+	if (!f) {
+		return libbpf_num_possible_cpus();
+	}
+	if (!fgets(buf, sizeof(buf), f)) {
+		fclose(f);
+		return libbpf_num_possible_cpus();
+	}
+	fclose(f);
+
+	// Ranges like 0-3,8,10-11
+	char *p = buf;
+	for (;;) {
+		long cpu = strtol(p, &p, 10);
+		if (*p == '-') {
+			cpu = strtol(p + 1, &p, 10);
+		}
+		if (cpu + 1 > n) {
+			n = cpu + 1;
+		}
+		if (*p != ',') {
+			break;
+		}
+		p++;
+	}
+	return n > 0 ? n : libbpf_num_possible_cpus();
+}
+
+// The settings the programs would be loaded with for this run's options
+static struct daemon_config wanted_config(void)
+{
+	return (struct daemon_config) {
+		.batch_results = env.interval_ms > 0,
+		.collect_stats = env.stats,
+		.collect_hists = env.hists,
+		.debug = env.debug,
+		.filter_comm = !any_exec(),
+		.watch_dirs = watch_dirs(),
+		.words_hash = fsm_hash(),
+	};
+}
+
+// .rodata has to be filled in before loading. The verifier sees the final
+// value of parser, so code for the other parsers is dropped
+static void set_rodata(struct day1_bpf *skel, const struct daemon_config *cfg)
+{
+	skel->rodata->parser = env.parser;
+	skel->rodata->batch_results = cfg->batch_results;
+	skel->rodata->collect_stats = cfg->collect_stats;
+	skel->rodata->collect_hists = cfg->collect_hists;
+	skel->rodata->debug = cfg->debug;
+	skel->rodata->filter_comm = cfg->filter_comm;
+	skel->rodata->watch_dirs = cfg->watch_dirs;
+	populate_dense_table(skel->rodata->dense_table);
+}
+
+static struct day1_bpf *open_and_load(enum load_mode mode)
+{
+	struct day1_bpf *skel;
+	int err;
 
-	char log_buf[64 * 1024];
 	LIBBPF_OPTS(bpf_object_open_opts, opts,
 		.kernel_log_buf = log_buf,
 		.kernel_log_size = sizeof(log_buf),
 		.kernel_log_level = 1,
+		.pin_root_path = PIN_ROOT,
 	);
 
 	skel = day1_bpf__open_opts(&opts);
 	if (!skel) {
 		printf("Failed to open BPF object\n");
-		return 1;
+		return NULL;
+	}
+
+	set_attach_mode(skel, mode);
+	bpf_map__set_max_entries(skel->maps.scratch, scratch_entries());
+	if (mode == LOAD_REPLAY || env.load_stats) {
+		// No results are produced, so don't touch the pinned map
+		bpf_map__set_pin_path(skel->maps.results, NULL);
+	} else if (env.daemon) {
+		pin_maps(skel);
 	}
 
+	struct daemon_config cfg = wanted_config();
+	set_rodata(skel, &cfg);
+
+	if (env.load_stats) {
+		for (int i = 0; i < skel->skeleton->prog_cnt && i < MAX_PROGS; i++) {
+			struct bpf_program *prog = *skel->skeleton->progs[i].prog;
+			memset(prog_logs[i], 0, PROG_LOG_SIZE);
+			bpf_program__set_log_buf(prog, prog_logs[i], PROG_LOG_SIZE);
+			bpf_program__set_log_level(prog, prog_log_level);
+		}
+	}
+
+	memset(log_buf, 0, sizeof(log_buf));
+	double start = now_ns();
 	err = day1_bpf__load(skel);
+	load_ns = now_ns() - start;
 	// Print the verifier log
-	for (int i=0; i < sizeof(log_buf); i++) {
+	for (int i=0; i < sizeof(log_buf) - 1; i++) {
 		if (log_buf[i] == 0 && log_buf[i+1] == 0) {
 			break;
 		}
@@ -207,54 +876,777 @@ int main()
 	}
 
 	if (err) {
-		printf("Failed to load BPF object\n");
+		if (!env.load_stats || prog_log_level) {
+			printf("Failed to load BPF object using %s\n", mode_names[mode]);
+		} else {
+			for (int i = 0; i < skel->skeleton->prog_cnt && i < MAX_PROGS; i++) {
+				if (prog_logs[i][0]) {
+					printf("%s:\n%s\n", skel->skeleton->progs[i].name, prog_logs[i]);
+				}
+			}
+		}
 		day1_bpf__destroy(skel);
-		return 1;
+		if (env.load_stats && prog_log_level) {
+			// Again, for the log of the program that failed
+			prog_log_level = 0;
+			day1_bpf__destroy(open_and_load(mode));
+			prog_log_level = 4;
+		}
+		return NULL;
 	}
 
-	// Define the executables & files we are interested in
-	filter_executable(skel, "cat");
-	filter_filename(skel, "advent");
-	filter_filename(skel, "advent.full");
-	filter_filename(skel, "advent.example");
-	filter_filename(skel, "advent.test");
-
-#ifdef PART2A
-	printf("Populated state table\n");
-	populate_state_table(skel);
-#endif
-
-	printf("%-8s %-6s %-8s %-16s %-6s\n", "TIME", "PID", "COMM", "FILE", "RESULT");
-
-	pb = perf_buffer__new(bpf_map__fd(skel->maps.events), PERF_BUFFER_PAGES,
-			      handle_event, lost_event, NULL, NULL);
-	if (!pb) {
-		err = -errno;
-		fprintf(stderr, "failed to open perf buffer: %d\n", err);
-		goto cleanup;
+	if (mode == LOAD_KPROBES) {
+		err = set_parser(skel, env.parser);
+		if (err) {
+			printf("Failed to set up tail call: %d\n", err);
+			day1_bpf__destroy(skel);
+			return NULL;
+		}
+	}
+
+	// Only p2a uses this, but the parser can be switched to it later
+	if (populate_state_table(skel)) {
+		day1_bpf__destroy(skel);
+		return NULL;
+	}
+
+	return skel;
+}
+
+// The links are what keep the probes attached, so they're pinned as
+// link_<program>. Once they're pinned the skeleton is told to let go of them
+// without detaching anything
+static int pin_links(struct day1_bpf *skel)
+{
+	char path[PATH_MAX];
+
+	for (int i = 0; i < skel->skeleton->prog_cnt; i++) {
+		struct bpf_link *link = *skel->skeleton->progs[i].link;
+		if (!link) {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/link_%s", PIN_ROOT, skel->skeleton->progs[i].name);
+		int err = bpf_link__pin(link, path);
+		if (err) {
+			fprintf(stderr, "Failed to pin %s: %d\n", path, err);
+			return err;
+		}
+		bpf_link__disconnect(link);
 	}
-	
-	// Attach the progam to the event
-	err = day1_bpf__attach(skel);
+	return 0;
+}
+
+// Remember what the daemon was started with, for open_pinned()
+static int save_daemon_config(struct day1_bpf *skel)
+{
+	struct daemon_config cfg = wanted_config();
+	__u32 zero = 0;
+
+	int err = bpf_map__update_elem(skel->maps.config, &zero, sizeof(zero), &cfg, sizeof(cfg), 0);
 	if (err) {
-		fprintf(stderr, "Failed to attach BPF skeleton: %d\n", err);
+		fprintf(stderr, "Failed to save the daemon's settings: %d\n", err);
+	}
+	return err;
+}
+
+// The pinned probes were loaded with the daemon's settings, and the files and
+// executables it watches are already in its maps, so options that would need
+// anything different can't be honoured. Say which ones, rather than quietly
+// carrying on without them. Returns the number of conflicts
+static int check_daemon_config(const struct daemon_config *have)
+{
+	int conflicts = 0;
+
+	if (env.nfiles) {
+		fprintf(stderr, "--file: the daemon is already watching the files it was started with\n");
+		conflicts++;
+	}
+	if (env.nexecs) {
+		fprintf(stderr, "--exec: the daemon is already watching the executables it was started with\n");
+		conflicts++;
+	}
+	if (env.prog_stats) {
+		fprintf(stderr, "--prog-stats: the daemon's programs weren't loaded by this run, so there are none to report on\n");
+		conflicts++;
+	}
+	if (env.interval_ms && !have->batch_results) {
+		fprintf(stderr, "--interval: the daemon was started without it, so results come as events\n");
+		conflicts++;
+	}
+	if (!env.interval_ms && have->batch_results) {
+		fprintf(stderr, "--interval: the daemon was started with it, so results only go to the results map\n");
+		conflicts++;
+	}
+	if (env.stats && !have->collect_stats) {
+		fprintf(stderr, "--stats: the daemon was started without it, so nothing is being counted\n");
+		conflicts++;
+	}
+	if (env.hists && !have->collect_hists) {
+		fprintf(stderr, "--histograms: the daemon was started without it, so nothing is being timed\n");
+		conflicts++;
+	}
+	if (env.debug && !have->debug) {
+		fprintf(stderr, "--debug: the daemon was started without it, so nothing is being traced\n");
+		conflicts++;
+	}
+	if (fsm_hash() != have->words_hash) {
+		fprintf(stderr, "--words: the daemon was started with a different word list\n");
+		conflicts++;
+	}
+	if (conflicts) {
+		fprintf(stderr, "Run day1 --unpin and start the daemon again to change these\n");
+	}
+	return conflicts;
+}
+
+// Whether an earlier day1 --daemon left its probes attached
+static bool daemon_pinned(void)
+{
+	return access(PIN_ROOT "/link_vfs_open", F_OK) == 0;
+}
+
+// Pick up where an earlier day1 --daemon left off. Nothing is attached or
+// detached, and no programs are verified, unless the parser is being switched:
+// then only buffer_read for the new parser is loaded, against the pinned maps,
+// and swapped into the tailcalls array. Reads carry on through the old parser
+// until the swap, and through the new one straight after it, with the same
+// per-file state
+static struct day1_bpf *open_pinned(void)
+{
+	struct daemon_config have;
+	struct bpf_program *prog;
+	struct day1_bpf *skel;
+	__u32 zero = 0;
+	int err;
+
+	int fd = bpf_obj_get(PIN_ROOT "/config");
+	if (fd < 0 || bpf_map_lookup_elem(fd, &zero, &have)) {
+		fprintf(stderr, "Failed to read the daemon's settings from " PIN_ROOT "/config\n");
+		if (fd >= 0) {
+			close(fd);
+		}
+		return NULL;
+	}
+	close(fd);
+	if (check_daemon_config(&have)) {
+		return NULL;
+	}
+
+	LIBBPF_OPTS(bpf_object_open_opts, opts,
+		.pin_root_path = PIN_ROOT,
+	);
+
+	skel = day1_bpf__open_opts(&opts);
+	if (!skel) {
+		printf("Failed to open BPF object\n");
+		return NULL;
+	}
+
+	bpf_object__for_each_program(prog, skel->obj) {
+		bpf_program__set_autoload(prog, false);
+	}
+	if (env.parser_set) {
+		char name[32];
+		snprintf(name, sizeof(name), "buffer_read_%s", parser_names[env.parser]);
+		bpf_program__set_autoload(bpf_object__find_program_by_name(skel->obj, name), true);
+	}
+
+	bpf_map__set_max_entries(skel->maps.scratch, scratch_entries());
+	pin_maps(skel);
+	set_rodata(skel, &have);
+
+	err = day1_bpf__load(skel);
+	if (err) {
+		printf("Failed to open pinned maps: %d\n", err);
+		day1_bpf__destroy(skel);
+		return NULL;
+	}
+
+	if (env.parser_set) {
+		err = set_parser(skel, env.parser);
+		if (err) {
+			printf("Failed to switch parser: %d\n", err);
+			day1_bpf__destroy(skel);
+			return NULL;
+		}
+		printf("switched to parser %s\n", parser_names[env.parser]);
+	}
+	return skel;
+}
+
+// Remove everything that's pinned. Unpinning the links detaches the probes,
+// and the maps go once nothing else is using them
+static int unpin_all(void)
+{
+	char path[PATH_MAX];
+	struct dirent *d;
+	int err = 0;
+
+	DIR *dir = opendir(PIN_ROOT);
+	if (!dir) {
+		return errno == ENOENT ? 0 : -errno;
+	}
+	while ((d = readdir(dir))) {
+		if (d->d_name[0] == '.') {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s", PIN_ROOT, d->d_name);
+		if (unlink(path)) {
+			fprintf(stderr, "Failed to unpin %s: %s\n", path, strerror(errno));
+			err = -errno;
+		}
+	}
+	closedir(dir);
+	if (!err) {
+		rmdir(PIN_ROOT);
+	}
+	return err;
+}
+
+static const char *counter_names[] = {
+	[COUNT_OPEN_MATCH] = "open_match",
+	[COUNT_OPEN_REJECT] = "open_reject",
+	[COUNT_READ_SKIP] = "read_skip",
+	[COUNT_READS] = "reads",
+	[COUNT_BYTES] = "bytes",
+	[COUNT_CHUNKS] = "chunks",
+	[COUNT_TAIL_CALLS] = "tail_calls",
+	[COUNT_TAIL_CALL_FAILS] = "tail_call_fails",
+	[COUNT_READ_FAILS] = "read_user_fails",
+	[COUNT_SHORT_LOOPS] = "short_loops",
+	[COUNT_NO_DATA] = "close_no_data",
+	[COUNT_NO_SPACE] = "no_space",
+	[COUNT_NO_SCRATCH] = "no_scratch",
+};
+
+// Add up the per-CPU counters
+static int read_counters(struct day1_bpf *skel, __u64 *totals)
+{
+	int ncpus = libbpf_num_possible_cpus();
+	__u64 values[ncpus];
+
+	for (__u32 i = 0; i < COUNTERS; i++) {
+		int err = bpf_map__lookup_elem(skel->maps.counters, &i, sizeof(i), values, sizeof(values), 0);
+		if (err) {
+			return err;
+		}
+		totals[i] = 0;
+		for (int cpu = 0; cpu < ncpus; cpu++) {
+			totals[i] += values[cpu];
+		}
+	}
+	return 0;
+}
+
+#define STATS_PERIOD_NS 1e9
+
+// Print the counters and how fast they've gone up since the last time, at
+// most once every STATS_PERIOD_NS unless final is set
+static void print_stats(struct day1_bpf *skel, bool final)
+{
+	static __u64 last[COUNTERS];
+	static double last_ns;
+	__u64 totals[COUNTERS];
+
+	double now = now_ns();
+	if (!final && now - last_ns < STATS_PERIOD_NS) {
+		return;
+	}
+	if (read_counters(skel, totals)) {
+		fprintf(stderr, "Failed to read counters\n");
+		return;
+	}
+
+	double secs = last_ns ? (now - last_ns) / 1e9 : 0;
+	printf("%-16s %14s %12s\n", "STAT", "TOTAL", "PER SEC");
+	for (int i = 0; i < COUNTERS; i++) {
+		printf("%-16s %14llu %12.1f\n", counter_names[i], (unsigned long long)totals[i],
+		       secs ? (totals[i] - last[i]) / secs : 0.0);
+	}
+	if (totals[COUNT_READS]) {
+		printf("%-16s %14.2f\n", "chunks/read", (double)totals[COUNT_CHUNKS] / totals[COUNT_READS]);
+	}
+	fflush(stdout);
+
+	memcpy(last, totals, sizeof(last));
+	last_ns = now;
+}
+
+static const struct {
+	const char *name;
+	const char *unit;
+} hist_names[] = {
+	[HIST_PARSE_NS] = { "parse time per read", "nsecs" },
+	[HIST_READ_BYTES] = { "bytes per read", "bytes" },
+	[HIST_OPEN_NS] = { "open to close", "nsecs" },
+	[HIST_PS_PER_BYTE] = { "parse time per byte", "psecs" },
+};
+
+static void print_stars(__u64 val, __u64 val_max, int width)
+{
+	int stars = val_max ? val * width / val_max : 0;
+	int spaces = width - stars;
+
+	for (int i = 0; i < stars; i++) {
+		printf("*");
+	}
+	for (int i = 0; i < spaces; i++) {
+		printf(" ");
+	}
+	if (val > val_max) {
+		printf("+");
+	}
+}
+
+// Print each histogram the way the bcc tools do, adding up every CPU's copy
+// of each bucket. Empty buckets at the top are left out
+static void print_hists(struct day1_bpf *skel)
+{
+	int ncpus = libbpf_num_possible_cpus();
+	__u64 values[ncpus];
+
+	for (int h = 0; h < HISTS; h++) {
+		__u64 slots[HIST_SLOTS] = {};
+		__u64 max = 0;
+		int top = -1;
+
+		for (__u32 i = 0; i < HIST_SLOTS; i++) {
+			__u32 key = h * HIST_SLOTS + i;
+			if (bpf_map__lookup_elem(skel->maps.hists, &key, sizeof(key), values, sizeof(values), 0)) {
+				fprintf(stderr, "Failed to read histograms\n");
+				return;
+			}
+			for (int cpu = 0; cpu < ncpus; cpu++) {
+				slots[i] += values[cpu];
+			}
+			if (slots[i]) {
+				top = i;
+			}
+			if (slots[i] > max) {
+				max = slots[i];
+			}
+		}
+
+		printf("\n%s\n", hist_names[h].name);
+		if (top < 0) {
+			printf("     (none)\n");
+			continue;
+		}
+		printf("%24s : count    distribution\n", hist_names[h].unit);
+		for (int i = 0; i <= top; i++) {
+			// Slot 0 is zero, slot i is 2^(i-1) to 2^i - 1
+			unsigned long long low = i ? 1ULL << (i - 1) : 0;
+			unsigned long long high = i ? (1ULL << i) - 1 : 0;
+			printf("%10llu -> %-10llu : %-8llu |", low, high, (unsigned long long)slots[i]);
+			print_stars(slots[i], max, 40);
+			printf("|\n");
+		}
+	}
+	fflush(stdout);
+}
+
+// Read the whole of a file into memory
+static char *read_file(const char *path, size_t *size)
+{
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	*size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	char *data = malloc(*size ? *size : 1);
+	if (!data || fread(data, 1, *size, f) != *size) {
+		fprintf(stderr, "Failed to read %s\n", path);
+		free(data);
+		data = NULL;
+	}
+	fclose(f);
+	return data;
+}
+
+// Push a file through the replay program chunk by chunk, as if it was being
+// read with chunk_size reads, and time it. Returns non-zero if any pass got
+// the wrong answer
+static int run_replay(struct day1_bpf *skel)
+{
+	size_t size;
+	char *data = read_file(env.replay_file, &size);
+	if (!data) {
+		return 1;
+	}
+
+	int fd = bpf_program__fd(skel->progs.replay);
+	struct replay_args args = {};
+	double prog_ns = 0;
+	long runs = 0;
+	long wrong = 0;
+	int err = 0;
+
+	double start = now_ns();
+	for (long r = 0; r < env.repeat; r++) {
+		for (size_t offset = 0; offset < size; offset += env.chunk_size) {
+			args.buf = (__u64)(unsigned long)(data + offset);
+			args.length = size - offset < env.chunk_size ? size - offset : env.chunk_size;
+			args.reset = offset == 0;
+
+			LIBBPF_OPTS(bpf_test_run_opts, topts,
+				.ctx_in = &args,
+				.ctx_size_in = sizeof(args),
+			);
+			err = bpf_prog_test_run_opts(fd, &topts);
+			if (err) {
+				fprintf(stderr, "Failed to run replay program: %d\n", err);
+				goto out;
+			}
+			prog_ns += args.run_ns;
+			runs++;
+		}
+		if (env.expect >= 0 && args.total != env.expect) {
+			wrong++;
+		}
+	}
+	double elapsed = now_ns() - start;
+	double bytes = (double)size * env.repeat;
+
+	printf("%s: %zu bytes in %ld byte chunks, %ld repeats, %ld runs\n",
+	       env.replay_file, size, env.chunk_size, env.repeat, runs);
+	printf("lines %u result %llu", args.lines, (unsigned long long)args.total);
+	if (env.expect >= 0) {
+		printf(" expected %lld: %s", env.expect, wrong ? "WRONG" : "OK");
+		if (wrong) {
+			printf(" (%ld of %ld repeats)", wrong, env.repeat);
+		}
+	}
+	printf("\n");
+	if (bytes > 0) {
+		printf("%.2f ns/byte parsing, %.2f ns/byte including BPF_PROG_TEST_RUN\n",
+		       prog_ns / bytes, elapsed / bytes);
+	}
+	err = wrong ? 1 : 0;
+
+out:
+	free(data);
+	return err;
+}
+
+int main(int argc, char **argv)
+{
+    struct day1_bpf *skel;
+	struct ring_buffer *rb = NULL;
+	int stats_fd = -1;
+
+    int err = 0;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "p:lsSr:c:n:e:i:dUkLHw:f:x:Dh", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'p':
+			env.parser = PARSERS;
+			for (int i = 0; i < PARSERS; i++) {
+				if (!strcmp(optarg, parser_names[i])) {
+					env.parser = i;
+				}
+			}
+			if (env.parser == PARSERS) {
+				fprintf(stderr, "Unknown parser %s\n", optarg);
+				usage(argv[0]);
+				return 1;
+			}
+			env.parser_set = true;
+			break;
+		case 'l':
+			env.latency = true;
+			break;
+		case 's':
+			env.prog_stats = true;
+			break;
+		case 'S':
+			env.stats = true;
+			break;
+		case 'r':
+			env.replay_file = optarg;
+			break;
+		case 'c':
+			env.chunk_size = atol(optarg);
+			break;
+		case 'n':
+			env.repeat = atol(optarg);
+			break;
+		case 'e':
+			env.expect = atoll(optarg);
+			break;
+		case 'i':
+			env.interval_ms = atol(optarg);
+			if (env.interval_ms <= 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'd':
+			env.daemon = true;
+			break;
+		case 'U':
+			env.unpin = true;
+			break;
+		case 'k':
+			env.kprobes = true;
+			break;
+		case 'L':
+			env.load_stats = true;
+			break;
+		case 'H':
+			env.hists = true;
+			break;
+		case 'w':
+			env.words_file = optarg;
+			break;
+		case 'f':
+			if (env.nfiles >= MAX_ARGS) {
+				usage(argv[0]);
+				return 1;
+			}
+			env.files[env.nfiles++] = optarg;
+			break;
+		case 'x':
+			if (env.nexecs >= MAX_ARGS) {
+				usage(argv[0]);
+				return 1;
+			}
+			env.execs[env.nexecs++] = optarg;
+			break;
+		case 'D':
+			env.debug = true;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (env.chunk_size <= 0 || env.repeat <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	struct sigaction act = {};
+    act.sa_handler = intHandler;
+    sigaction(SIGINT, &act, NULL);
+    act.sa_handler = usr1Handler;
+    sigaction(SIGUSR1, &act, NULL);
+
+	libbpf_set_strict_mode(LIBBPF_STRICT_ALL);
+	libbpf_set_print(libbpf_print_fn);
+
+	struct fsm_word words[MAX_WORDS];
+	int word_count = sizeof(default_words) / sizeof(default_words[0]);
+	memcpy(words, default_words, sizeof(default_words));
+	if (env.words_file && read_words(env.words_file, words, &word_count)) {
+		return 1;
+	}
+	if (build_fsm(words, word_count)) {
+		return 1;
+	}
+
+	// A daemon that's already running keeps the files and executables it
+	// was started with, so there are no defaults to fill in for it, and
+	// open_pinned() can tell whether --file or --exec were given
+	bool reuse = env.daemon && daemon_pinned();
+	if (!reuse && !env.nfiles) {
+		env.files[env.nfiles++] = "advent*";
+	}
+	if (!reuse && !env.nexecs) {
+		env.execs[env.nexecs++] = "cat";
+		env.execs[env.nexecs++] = "reader";
+	}
+	if (!env.replay_file && !env.load_stats && !env.unpin && !reuse && resolve_targets()) {
+		return 1;
+	}
+
+	if (env.replay_file) {
+		skel = open_and_load(LOAD_REPLAY);
+		if (!skel) {
+			return 1;
+		}
+		err = run_replay(skel);
+		if (env.stats) {
+			print_stats(skel, true);
+		}
+		day1_bpf__destroy(skel);
+		return err;
+	}
+
+	if (env.unpin) {
+		return unpin_all() ? 1 : 0;
+	}
+
+	skel = NULL;
+	if (reuse) {
+		skel = open_pinned();
+		if (!skel) {
+			return 1;
+		}
+		printf("using pinned probes from %s\n", PIN_ROOT);
+		goto attached;
+	}
+
+	// Trampolines are cheaper than kprobes (and especially kretprobes), but
+	// they need BTF and arch support, so fall back to kprobes if either the
+	// load or the attach fails. A daemon goes straight to kprobes: the parser
+	// has to be a tail call so that it can be swapped while attached, and
+	// there's no way to replace an fexit program in place
+	if (!env.daemon && !env.kprobes) {
+		skel = open_and_load(LOAD_TRAMPOLINES);
+		if (!skel && env.load_stats) {
+			// Falling back would give the numbers for kprobes as if
+			// they were for fentry/fexit
+			return 1;
+		}
+	}
+	if (skel && env.load_stats) {
+		printf("MODE %s\n", mode_names[LOAD_TRAMPOLINES]);
+		print_load_stats(skel);
+		day1_bpf__destroy(skel);
+		return 0;
+	}
+	if (skel) {
+		err = day1_bpf__attach(skel);
+		if (err) {
+			fprintf(stderr, "Failed to attach fentry/fexit programs: %d\n", err);
+			day1_bpf__destroy(skel);
+			skel = NULL;
+		}
+	}
+	if (!skel) {
+		if (!env.daemon && !env.kprobes) {
+			printf("Falling back to kprobes\n");
+		}
+		skel = open_and_load(LOAD_KPROBES);
+		if (!skel) {
+			return 1;
+		}
+		if (env.load_stats) {
+			printf("MODE %s\n", mode_names[LOAD_KPROBES]);
+			print_load_stats(skel);
+			day1_bpf__destroy(skel);
+			return 0;
+		}
+		err = day1_bpf__attach(skel);
+		if (err) {
+			fprintf(stderr, "Failed to attach BPF skeleton: %d\n", err);
+			day1_bpf__destroy(skel);
+			return 1;
+		}
+	}
+	if (env.daemon && (save_daemon_config(skel) || pin_links(skel))) {
 		day1_bpf__destroy(skel);
-        return 1;
+		unpin_all();
+		return 1;
+	}
+
+	// Define the executables & files we are interested in
+	for (int i = 0; i < env.nexecs; i++) {
+		if (strcmp(env.execs[i], "*")) {
+			filter_executable(skel, env.execs[i]);
+		}
+	}
+	filter_targets(skel);
+	printf("using parser %s\n", parser_names[env.parser]);
+
+attached:
+
+	if (env.prog_stats) {
+		// Stats are collected for as long as this fd is open
+		stats_fd = bpf_enable_stats(BPF_STATS_RUN_TIME);
+		if (stats_fd < 0) {
+			fprintf(stderr, "Failed to enable BPF stats: %d\n", stats_fd);
+		}
 	}
 
+	printf("%-8s %-6s %-8s %-16s %-6s", "TIME", "PID", "COMM", "FILE", "RESULT");
+	if (env.latency) {
+		printf(" %10s", "LAT(us)");
+	}
+	if (env.interval_ms) {
+		printf(" %8s %10s %6s", "LINES", "BYTES", "CLOSES");
+	}
+	printf("\n");
+
+	if (env.interval_ms) {
+		// Results pile up in the map and are read in bulk. SIGINT cuts the
+		// sleep short, and whatever's left is read on the way out
+		struct timespec interval = {
+			.tv_sec = env.interval_ms / 1000,
+			.tv_nsec = (env.interval_ms % 1000) * 1000000,
+		};
+		fflush(stdout);
+		while (keepRunning) {
+			nanosleep(&interval, NULL);
+			err = drain_results(skel);
+			if (err) {
+				goto cleanup;
+			}
+			if (env.stats) {
+				print_stats(skel, false);
+			}
+			if (showHists && env.hists) {
+				showHists = false;
+				print_hists(skel);
+			}
+		}
+		goto stats;
+	}
 
+	rb = ring_buffer__new(bpf_map__fd(skel->maps.events), handle_event, NULL, NULL);
+	if (!rb) {
+		err = -errno;
+		fprintf(stderr, "failed to open ring buffer: %d\n", err);
+		goto cleanup;
+	}
+
+	// Block until there's an event, or with --stats until it's time to print
+	// them. SIGINT and SIGUSR1 interrupt the wait
 	while (keepRunning) {
-		err = perf_buffer__poll(pb, PERF_POLL_TIMEOUT_MS);
+		err = ring_buffer__poll(rb, env.stats ? STATS_PERIOD_NS / 1e6 : -1);
 		if (err < 0 && err != -EINTR) {
-			fprintf(stderr, "error polling perf buffer: %s\n", strerror(-err));
+			fprintf(stderr, "error polling ring buffer: %s\n", strerror(-err));
 			goto cleanup;
 		}
+		if (env.stats) {
+			print_stats(skel, false);
+		}
+		if (showHists && env.hists) {
+			showHists = false;
+			print_hists(skel);
+		}
 		/* reset err to return 0 if exiting */
 		err = 0;		
 	}
 
+	__u32 zero = 0;
+	__u64 dropped = 0;
+	if (!bpf_map__lookup_elem(skel->maps.dropped_events, &zero, sizeof(zero), &dropped, sizeof(dropped), 0) && dropped) {
+		printf("%llu events dropped\n", (unsigned long long)dropped);
+	}
+
+stats:
+	if (env.stats) {
+		print_stats(skel, true);
+		print_map_memory(skel);
+	}
+	if (env.hists) {
+		print_hists(skel);
+	}
+	if (env.prog_stats) {
+		print_prog_stats(skel);
+	}
+
 cleanup:
-	perf_buffer__free(pb);
+	if (stats_fd >= 0) {
+		close(stats_fd);
+	}
+	ring_buffer__free(rb);
 	day1_bpf__destroy(skel);
 	return -err;
 }
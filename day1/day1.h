@@ -5,16 +5,85 @@
 struct event {
 	char filename[DNAME_INLINE_LEN];
 	char task[TASK_COMM_LEN];
-   __u32 result;
+   __u64 result;
 	pid_t pid;
+	// bpf_ktime_get_ns() when the file was closed
+	__u64 close_ns;
+	// Out of order reads that couldn't be joined up with the rest of the
+	// file, so the result is missing them
+	__u32 unmerged;
+	// Reads whose data we couldn't see (splice, sendfile, mmap and so on)
+	__u32 bypassed;
+};
+
+// A file or directory. dev is the kernel's encoding (major << 20 | minor), not
+// the one stat() gives user space
+struct inode_key {
+	__u64 ino;
+	__u32 dev;
+	__u32 pad;
+};
+
+// What an entry in the targets map is
+enum target_kind {
+	TARGET_FILE = 1,
+	// Files anywhere below this directory, up to MAX_DIR_DEPTH levels down
+	TARGET_DIR,
+};
+
+#define MAX_DIR_DEPTH		8
+
+// Results are also kept per file in the results map, which is pinned so other
+// tools can read it, and which day1 --interval drains in batches instead of
+// reading the event stream
+struct result_t {
+	char filename[DNAME_INLINE_LEN];
+	char task[TASK_COMM_LEN];
+	// Total, number of lines and number of bytes the last time the file was
+	// read and closed
+	__u64 result;
+	__u64 lines;
+	__u64 bytes;
+	__u64 close_ns;
+	pid_t pid;
+	// Number of times the file has been closed since this entry was made
+	__u32 closes;
+	__u32 unmerged;
+	__u32 bypassed;
+};
+
+// Context for the replay program. User space passes it in with
+// BPF_PROG_TEST_RUN and gets it back with the out fields filled in
+struct replay_args {
+	// User space address and length of the chunk to parse
+	__u64 buf;
+	__u64 length;
+	// Non-zero for the first chunk of a file
+	__u32 reset;
+	// Out: lines and total parsed so far in this file
+	__u32 lines;
+	__u64 total;
+	// Out: time spent parsing this chunk
+	__u64 run_ns;
 };
 
 struct executable_t {
    char name[TASK_COMM_LEN];
 };
 
-struct filename_t {
-   char name[DNAME_INLINE_LEN];
+// What day1 --daemon was started with. It's kept in the pinned config map, so
+// that a later day1 --daemon that picks up the probes can load a new parser
+// with the same settings, and refuse options the probes can't honour
+struct daemon_config {
+	__u32 batch_results;
+	__u32 collect_stats;
+	__u32 collect_hists;
+	__u32 debug;
+	__u32 filter_comm;
+	__u32 watch_dirs;
+	// Hash of the digit words the state tables were built from
+	__u32 words_hash;
+	__u32 pad;
 };
 
 struct state_input {
@@ -24,6 +93,77 @@ struct state_input {
 
 struct state_output {
 	char new_state;
+	// Value of the word that ends with this input, if any, and its length
 	char output;
+	char length;
+};
+
+// Parsers, chosen with day1 --parser
+enum advent_parser {
+	PARSER_P1,
+	PARSER_P1S,
+	PARSER_P1B,
+	PARSER_P2,
+	PARSER_P2A,
+	PARSER_P2B,
+	PARSERS,
 };
 
+// Counters kept per CPU in the counters map, for day1 --stats
+enum advent_counter {
+	// Opens of a file we want by an executable we want, and all the others
+	COUNT_OPEN_MATCH,
+	COUNT_OPEN_REJECT,
+	// Reads that got as far as looking for a stream and didn't find one
+	COUNT_READ_SKIP,
+	// Reads parsed, bytes parsed and the chunks they were parsed in
+	COUNT_READS,
+	COUNT_BYTES,
+	COUNT_CHUNKS,
+	// Tail calls into buffer_read (kprobes only), and ones that didn't happen
+	COUNT_TAIL_CALLS,
+	COUNT_TAIL_CALL_FAILS,
+	// bpf_probe_read_user() failures
+	COUNT_READ_FAILS,
+	// bpf_loop() stopping before it had been round as many times as asked
+	COUNT_SHORT_LOOPS,
+	// Files closed with nothing parsed
+	COUNT_NO_DATA,
+	// Somewhere to keep state we couldn't get: task storage, a free stream
+	// slot, or room in the summaries map
+	COUNT_NO_SPACE,
+	// Reads not parsed because this CPU's scratch buffer was in use by a
+	// task that had been preempted, or this CPU didn't have one
+	COUNT_NO_SCRATCH,
+	COUNTERS,
+};
+
+// Log2 histograms kept per CPU in the hists map, for day1 --histograms. Each
+// one has HIST_SLOTS buckets; bucket n counts values from 2^(n-1) to 2^n - 1
+enum advent_hist {
+	// Time spent parsing each read, which is what it adds to the reader's
+	// read() call, and the size of each read
+	HIST_PARSE_NS,
+	HIST_READ_BYTES,
+	// Time from a file being opened to it being closed
+	HIST_OPEN_NS,
+	// Parse time for each read divided by its size, in picoseconds, as
+	// parsing a byte takes well under a nanosecond with the faster parsers
+	HIST_PS_PER_BYTE,
+	HISTS,
+};
+
+#define HIST_SLOTS		32
+
+// Most states the dense version of the state table (p2b) can have. The table
+// is generated from a word list by day1, and one..nine needs 25
+#define FSM_STATES		64
+#define FSM_INPUTS		256
+
+// Longest word the state machine can look for. Reads are joined up by checking
+// the MAX_WORD_LEN - 1 bytes either side of each join for words
+#define MAX_WORD_LEN		9
+
+
+// Tail calls
+#define DO_BUFFER_READ 0
@@ -0,0 +1,122 @@
+// For Day 1 Part 1, a line at a time. Only the first and last digit of each
+// line matter, so rather than looking at every byte, each line is scanned
+// forward from its start as far as the first digit, then the newline at its
+// end is found a word at a time, and then it's scanned backward from the end as
+// far as the last digit. The bytes in between are only ever looked at as part
+// of a word, to find the newline.
+//
+// Each bpf_loop callback takes one step (one byte forward, one word looking
+// for the newline, or one byte backward), and the callback keeps track of
+// where it's got to in the chunk itself, returning 1 once it reaches the end.
+// A line that carries on into the next chunk or read is scanned backward from
+// the end of the chunk, so last_digit holds the last digit seen so far and the
+// next chunk's backward scan only has to look as far back as its own start.
+// That's all the carry a line needs, since the bytes before it never matter
+// again.
+
+enum {
+	// Looking for the first digit of the line
+	P1B_FORWARD,
+	// Looking for the newline at the end of the line
+	P1B_NEWLINE,
+	// Looking back from the end of the line for its last digit
+	P1B_BACKWARD,
+};
+
+// Most bpf_loop callbacks a chunk of length bytes can need. Forward and
+// backward steps never look at the same byte, and there's at most one word
+// more than the line's length / 8 and one final step for each line with a
+// digit in, which takes at least two bytes
+#define P1B_LOOPS(length) (3 * (length) + 1)
+
+// The line being scanned backward is done with: if it ended in this chunk
+// count it and start on the next one, otherwise the chunk is finished
+static __always_inline long p1b_end_line(struct advent_state *astate) {
+	if (astate->line_end >= astate->length) {
+		astate->pos = astate->length;
+		return 1;
+	}
+	end_line(astate);
+	astate->pos = astate->line_end + 1;
+	astate->phase = P1B_FORWARD;
+	return 0;
+}
+
+static long examine_line_p1b(u32 index, struct advent_state *astate) {
+
+	if (index == 0) {
+		// A line carried over from the last chunk that already has its
+		// first digit only needs its end finding
+		astate->pos = 0;
+		astate->stop = 0;
+		astate->phase = astate->ls.first_digit == -1 ? P1B_FORWARD : P1B_NEWLINE;
+	}
+
+	u32 pos = astate->pos;
+	switch (astate->phase) {
+	case P1B_FORWARD: {
+		if (pos >= astate->length || pos >= ADVENT_BUFFER_LEN) {
+			return 1;
+		}
+		char c = astate->buffer[pos];
+		astate->pos = pos + 1;
+		if (c >= '0' && c <= '9') {
+			astate->ls.first_digit = c - '0';
+			astate->ls.last_digit = c - '0';
+			// The backward scan doesn't need to come back past here
+			astate->stop = pos + 1;
+			astate->phase = P1B_NEWLINE;
+		} else if (c == '\n') {
+			end_line(astate);
+		}
+		return 0;
+	}
+
+	case P1B_NEWLINE: {
+		if (pos >= astate->length) {
+			// The line carries on into the next chunk
+			astate->line_end = astate->length;
+			astate->pos = astate->length;
+			astate->phase = P1B_BACKWARD;
+			return 0;
+		}
+
+		// Look at the aligned word that pos is in, ignoring the bytes
+		// before pos and any past the end of the chunk
+		u32 base = pos & ~(sizeof(u64) - 1);
+		if (base > ADVENT_BUFFER_LEN - sizeof(u64)) {
+			return 1;
+		}
+		u64 w = *(u64 *)(astate->buffer + base);
+		u64 newlines = newline_mask(w) & (~0ULL << ((pos - base) * 8));
+		u32 valid = astate->length - base;
+		if (valid < sizeof(u64)) {
+			newlines &= (1ULL << (valid * 8)) - 1;
+		}
+
+		if (!newlines) {
+			astate->pos = base + sizeof(u64);
+			return 0;
+		}
+		astate->line_end = base + lowest_byte(newlines);
+		astate->pos = astate->line_end;
+		astate->phase = P1B_BACKWARD;
+		return 0;
+	}
+
+	case P1B_BACKWARD: {
+		// pos is one past the byte to look at
+		if (pos <= astate->stop || pos > ADVENT_BUFFER_LEN) {
+			return p1b_end_line(astate);
+		}
+		char c = astate->buffer[pos - 1];
+		if (c >= '0' && c <= '9') {
+			astate->ls.last_digit = c - '0';
+			return p1b_end_line(astate);
+		}
+		astate->pos = pos - 1;
+		return 0;
+	}
+	}
+	return 1;
+}
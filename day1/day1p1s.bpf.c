@@ -0,0 +1,115 @@
+// For Day 1 Part 1, looking at a word (8 bytes) of the buffer at a time rather
+// than a character. Each bpf_loop callback builds a mask of the digits and a
+// mask of the newlines in its word, and then deals with each line (or part of a
+// line) in the word with a few bit operations. The line state carries over from
+// one word to the next in the same way it does from one character to the next,
+// so lines that cross a word boundary need no special handling.
+
+#define ONES	0x0101010101010101ULL
+#define HIGHS	0x8080808080808080ULL
+#define LOWS	0x7f7f7f7f7f7f7f7fULL
+
+// Top bit set in every byte of w that is an ASCII digit
+static __always_inline u64 digit_mask(u64 w) {
+	u64 x = w & LOWS;
+	// Top bit set where x >= '0', and where x > '9'. Neither sum can carry
+	// into the next byte
+	u64 ge0 = (x + ONES * (0x80 - '0')) & HIGHS;
+	u64 gt9 = (x + ONES * (0x80 - '9' - 1)) & HIGHS;
+	return ge0 & ~gt9 & ~w & HIGHS;
+}
+
+// Top bit set in every byte of w that is a newline
+static __always_inline u64 newline_mask(u64 w) {
+	u64 x = w ^ (ONES * '\n');
+	return ~(((x & LOWS) + LOWS) | x) & HIGHS;
+}
+
+// Index of the lowest and highest bytes with a bit set in m, which must not be
+// zero. These are count trailing/leading zeros divided by 8, done as a binary
+// search so the compiler doesn't need a lookup table
+static __always_inline u32 lowest_byte(u64 m) {
+	u32 i = 0;
+	if (!(m & 0xffffffffULL)) {
+		i += 4;
+		m >>= 32;
+	}
+	if (!(m & 0xffffULL)) {
+		i += 2;
+		m >>= 16;
+	}
+	if (!(m & 0xffULL)) {
+		i += 1;
+	}
+	return i;
+}
+
+static __always_inline u32 highest_byte(u64 m) {
+	u32 i = 0;
+	if (m >> 32) {
+		i += 4;
+		m >>= 32;
+	}
+	if (m >> 16) {
+		i += 2;
+		m >>= 16;
+	}
+	if (m >> 8) {
+		i += 1;
+	}
+	return i;
+}
+
+static __always_inline s8 byte_digit(u64 w, u32 i) {
+	return ((w >> (i * 8)) & 0xff) - '0';
+}
+
+static long examine_word_p1s(u32 index, struct advent_state *astate) {
+
+	if (index >= ADVENT_BUFFER_LEN / sizeof(u64)) {
+		return 1;
+	}
+
+	// The scratch buffer is 8-byte aligned, and BPF targets are little endian
+	// so byte i of the word is bits 8i to 8i+7
+	u64 w = *(u64 *)(astate->buffer + index * sizeof(u64));
+	u64 digits = digit_mask(w);
+	u64 newlines = newline_mask(w);
+
+	// Ignore anything past the end of the chunk in the last word
+	u32 valid = astate->length - index * sizeof(u64);
+	if (valid < sizeof(u64)) {
+		u64 keep = (1ULL << (valid * 8)) - 1;
+		digits &= keep;
+		newlines &= keep;
+	}
+
+	// At most 8 newlines, so at most 9 pieces of line in a word
+	for (u32 i = 0; i < sizeof(u64) + 1; i++) {
+		// The newline ending this piece, or zero if the line carries on into
+		// the next word
+		u64 nl = newlines & -newlines;
+		u64 line = nl ? digits & (nl - 1) : digits;
+
+		if (line) {
+			if (astate->ls.first_digit == -1) {
+				astate->ls.first_digit = byte_digit(w, lowest_byte(line));
+			}
+			astate->ls.last_digit = byte_digit(w, highest_byte(line));
+		}
+
+		if (!nl) {
+			break;
+		}
+
+		// New line
+		end_line(astate);
+		// bpf_printk("examine_word: new line %d, total so far %d", astate->ls.lines, astate->ls.total);
+
+		// Drop everything up to and including this newline. If it was the
+		// last byte, nl << 1 is zero and so is what's left
+		digits &= ~((nl << 1) - 1);
+		newlines &= newlines - 1;
+	}
+	return 0;
+}
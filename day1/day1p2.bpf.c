@@ -1,22 +1,18 @@
-#include "day1p2.h"
-
 // For Day 1 part 2, a straightforward solution
-static long examine_char(u32 index, struct advent_state *astate) {
-	struct digit_state_t *ds = bpf_map_lookup_elem(&digit_state, &astate->pid);
-	if (!ds) {
-		bpf_printk("examine_char2: no digit state for pid %d", astate->pid);
-		return 1;
-	}
+static long examine_char_p2(u32 index, struct advent_state *astate) {
+	// The word state lives in astate, which is on buffer_read's stack, so
+	// there's no map access per character
+	s8 *ds = astate->ls.text_digits;
 
-	s8 one = ds->text_digits[1];
-	s8 two = ds->text_digits[2];
-	s8 three = ds->text_digits[3];
-	s8 four = ds->text_digits[4];
-	s8 five = ds->text_digits[5];
-	s8 six = ds->text_digits[6];
-	s8 seven = ds->text_digits[7];
-	s8 eight = ds->text_digits[8];
-	s8 nine = ds->text_digits[9];
+	s8 one = ds[1];
+	s8 two = ds[2];
+	s8 three = ds[3];
+	s8 four = ds[4];
+	s8 five = ds[5];
+	s8 six = ds[6];
+	s8 seven = ds[7];
+	s8 eight = ds[8];
+	s8 nine = ds[9];
 
 	if (index < ADVENT_BUFFER_LEN) {
 		// bpf_printk("examine_char p2: [%d] %c (%d)", index, astate->buffer[index], astate->buffer[index]);
@@ -125,42 +121,38 @@ static long examine_char(u32 index, struct advent_state *astate) {
 		}
 
 		if (c >= '0' && c <= '9') {
-			if (astate->first_digit == -1) {
+			if (astate->ls.first_digit == -1) {
 				// bpf_printk("examine_char2: first digit %c", c);
-				astate->first_digit = c - '0';
+				astate->ls.first_digit = c - '0';
 			} 
 			// bpf_printk("examine_char2: candidate last digit %c", c);
-			astate->last_digit = c - '0';
+			astate->ls.last_digit = c - '0';
 		}
 
 		if (c == 10) {
-			if ((astate->first_digit < 0) || (astate->last_digit < 0)) {
-				bpf_printk("No first or last digit to add");
+			if ((astate->ls.first_digit < 0) || (astate->ls.last_digit < 0)) {
+				debug_printk("No first or last digit to add");
 			} else {
-				astate->total = astate->total + (astate->first_digit * 10) + astate->last_digit;
-				// bpf_printk("examine_char2: line %d first digit %d, last digit %d", astate->lines, astate->first_digit, astate->last_digit);
-				bpf_printk("examine_char p2: line %d, %d %d total: %d ", astate->lines + 1, astate->first_digit, astate->last_digit, astate->total);
+				// bpf_printk("examine_char2: line %d first digit %d, last digit %d", astate->ls.lines, astate->ls.first_digit, astate->ls.last_digit);
+				debug_printk("examine_char p2: line %d, %d %d", astate->ls.lines + 1, astate->ls.first_digit, astate->ls.last_digit);
 			}
 
-			astate->first_digit = -1;
-			astate->last_digit = -1;
-			astate->lines = astate->lines + 1;
+			end_line(astate);
 			one = 0; two = 0; three = 0; four = 0; five = 0; six = 0; seven = 0; eight = 0; nine = 0;
 
-			bpf_printk("examine_char p2: total so far %d", astate->total);
+			debug_printk("examine_char p2: total so far %d", astate->ls.total);
 		}
 	}
 
-	ds->text_digits[1] = one;
-	ds->text_digits[2] = two;
-	ds->text_digits[3] = three;
-	ds->text_digits[4] = four;
-	ds->text_digits[5] = five;
-	ds->text_digits[6] = six;
-	ds->text_digits[7] = seven;
-	ds->text_digits[8] = eight;
-	ds->text_digits[9] = nine;
-	bpf_map_update_elem(&digit_state, &astate->pid, ds, 0);
+	ds[1] = one;
+	ds[2] = two;
+	ds[3] = three;
+	ds[4] = four;
+	ds[5] = five;
+	ds[6] = six;
+	ds[7] = seven;
+	ds[8] = eight;
+	ds[9] = nine;
 
 	return 0;
 }
@@ -0,0 +1,38 @@
+// Dense version of the state table, indexed by state * FSM_INPUTS + input. It's
+// built in user space from the same entries as state_table, with the "retry
+// from state 0" case already folded in, and it's frozen before the program is
+// loaded. That makes each character a single indexed read with no hashing.
+const volatile struct state_output dense_table[FSM_STATES * FSM_INPUTS] = {};
+
+// For Day 1 Part 2, using the state machine with the dense table
+static long examine_char_p2b(u32 index, struct advent_state *astate) {
+
+	if (index < ADVENT_BUFFER_LEN) {
+		// bpf_printk("examine_char p2b: [%d] %c (%d)", index, astate->buffer[index], astate->buffer[index]);
+		char c = astate->buffer[index];
+
+		u32 i = ((u8)astate->ls.table_state * FSM_INPUTS) + (u8)c;
+		if (i >= FSM_STATES * FSM_INPUTS) {
+			// Shouldn't happen, but treat an unknown state like state 0
+			i = (u8)c;
+		}
+
+		if (dense_table[i].output > 0) {
+			c = dense_table[i].output + '0';
+		}
+		astate->ls.table_state = dense_table[i].new_state;
+
+		if (c >= '1' && c <= '9') {
+			if (astate->ls.first_digit == -1) {
+				astate->ls.first_digit = c - '0';
+			}
+			astate->ls.last_digit = c - '0';
+		}
+		if (c == 10) {
+			debug_printk("p2b: line %d, %d %d", astate->ls.lines + 1, astate->ls.first_digit, astate->ls.last_digit);
+			end_line(astate);
+			astate->ls.table_state = 0;
+		}
+	}
+	return 0;
+}